@@ -24,9 +24,20 @@
 #define AHO_CORASICK_HPP
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
 #include <set>
 #include <queue>
+#include <thread>
 #include <vector>
 #include <functional>
 
@@ -37,6 +48,40 @@
 
 #endif
 
+#if !defined(AHO_CORASICK_NOMMAP) && (defined(__unix__) || defined(__APPLE__))
+#define AHO_CORASICK_MMAP
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+#if !defined(AHO_CORASICK_NOSIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define AHO_CORASICK_X86_SIMD
+
+#include <immintrin.h>
+
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AHO_CORASICK_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define AHO_CORASICK_PREFETCH(address) ((void) 0)
+#endif
+
+// define AHO_CORASICK_SCAN_COUNTERS to have every scan add to aho_corasick::thread_scan_counters(), without it the
+// counting compiles to nothing.
+#ifdef AHO_CORASICK_SCAN_COUNTERS
+#define AHO_CORASICK_COUNT(counter, n) (::aho_corasick::thread_scan_counters().counter += (n))
+#else
+#define AHO_CORASICK_COUNT(counter, n) ((void) 0)
+#endif
+
 
 namespace aho_corasick {
 
@@ -71,323 +116,4004 @@ namespace aho_corasick {
         return it->second;
     }
 
-    // class state
-    template<typename string_type, typename value_type>
-    class state {
-    public:
-        using CharType = typename string_type::value_type;
-        typedef state<string_type, value_type> *ptr;
-        typedef std::unique_ptr<state<string_type, value_type>> unique_ptr;
-        typedef string_type &string_ref_type;
-        typedef std::vector<ptr> state_collection;
-        typedef std::vector<CharType> transition_collection;
-
-        std::vector<std::pair<CharType, unique_ptr> > d_success;
-        ptr d_failure;
-        std::unique_ptr<value_type> payload; // every pattern gets only a single payload (value, whatever the pattern matches to), the submatches that end at the current position are failure-nodes of this node.
-        std::size_t depth; // not needed for the actual algo.
+    // what the scans of one thread did, to see why a dictionary or an input is slow.
+    struct scan_counters {
+        std::uint64_t symbols; // fed to the automaton.
+        std::uint64_t skipped_symbols; // passed over by the start-byte prefilter, not fed.
+        std::uint64_t failure_hops; // failure links followed.
+        std::uint64_t states_visited; // states whose transitions were looked at: symbols + failure hops.
+        std::uint64_t matches; // reported, or counted by the queries.
 
-        state(const std::size_t depth_ = 0) :
-                d_success(),
-                d_failure(nullptr),
-                depth(depth_) {
+        void reset() {
+            *this = scan_counters();
         }
 
-        ptr lookupchild(const CharType &character) const {
-            return getNoCreateOrderedUniqueKV(d_success, character).get();
+        double failure_hops_per_symbol() const {
+            return symbols ? static_cast<double>(failure_hops) / symbols : 0;
         }
+    };
 
-        ptr next_state_no_failure(const CharType &c, ptr root) const {
-            auto ret = lookupchild(c);
-            if (ret == nullptr && this == root) {
-                return root;
-            }
-            return ret;
-        }
+    // only counts with AHO_CORASICK_SCAN_COUNTERS defined.
+    inline scan_counters &thread_scan_counters() {
+        static thread_local scan_counters counters = scan_counters();
+        return counters;
+    }
 
-        bool set_value(const value_type &v) {
-            if (payload.get() && *payload.get() == v) {
-                return false;
+    template<typename value_type>
+    struct begin_end_value {
+        const std::size_t begin;
+        const std::size_t end;
+        const value_type &v;
+
+        bool operator<(const begin_end_value &o) const {
+            if (begin == o.begin) {
+                if (end == o.end) {
+                    return v < o.v;
+                } else {
+                    return end < o.end;
+                }
+            } else {
+                return begin < o.begin;
             }
-            payload.reset(new value_type(v));
-            return true;
         }
 
-        template<typename iteratortype, typename callbackfct>
-        bool iterate_values(const iteratortype &pos,
-                            const callbackfct &fct) const {
+        bool operator==(const begin_end_value &o) const {
+            return begin == o.begin && end == o.end && v == o.v;
+        }
+    };
 
-            if (payload.get()) {
-                auto posbegin = pos; // todo: figure out how to do this the right way ...
-                for (std::size_t i = 0; i + 1 < depth; ++i) {
-                    --posbegin;
-                }
-                //	  std::advance(posbegin, -1 -(int)depth);
-                auto posend = pos;
-                ++posend;
-                //	  std::advance(posend, 1);
+    // compact match: offsets within the document and the pattern (value index of a compiled_trie, see value()).
+    struct match_record {
+        std::uint32_t begin;
+        std::uint32_t end;
+        std::uint32_t pattern;
 
-                if (!fct(*payload, posbegin, posend)) {
-                    return false;
-                }
-            }
-            return d_failure ? d_failure->iterate_values(pos, fct) : true;
+        bool operator==(const match_record &o) const {
+            return begin == o.begin && end == o.end && pattern == o.pattern;
         }
     };
 
-    template<typename string_type, typename value_type>
-    class basic_trie {
+    // the matches of a batch of documents in one flat buffer, document d owns [offsets()[d], offsets()[d + 1]).
+    // clear() keeps the capacity, so reusing a batch stops allocating once it has seen the largest batch.
+    class match_batch {
+        std::vector<match_record> d_records;
+        std::vector<std::size_t> d_offsets;
+        std::vector<std::vector<match_record> > d_lanes; // scratch of the documents walked together, kept by clear().
+
     public:
-        using CharType = typename string_type::value_type;
+        match_batch() :
+                d_records(),
+                d_offsets(1, 0),
+                d_lanes() {
+        }
 
-        typedef string_type &string_ref_type;
-        typedef state<string_type, value_type> state_type;
-        typedef state<string_type, value_type> *state_ptr_type;
+        void clear() {
+            d_records.clear();
+            d_offsets.resize(1);
+        }
 
-    private:
-        std::unique_ptr<state_type> d_root;
-        bool d_constructed_failure_states;
+        std::size_t document_count() const {
+            return d_offsets.size() - 1;
+        }
 
-    public:
-        basic_trie() :
-                d_root(new state_type()),
-                d_constructed_failure_states(false) {
+        const match_record *begin(std::size_t document) const {
+            return d_records.data() + d_offsets[document];
         }
 
-        state_ptr_type add_state(state_ptr_type cur_state, const CharType &character) {
-            auto &p = getOrCreateOrderedUniqueKV(cur_state->d_success, character);
-            if (!p.get()) {
-                p.reset(new state<string_type, value_type>(cur_state->depth + 1));
-                d_constructed_failure_states = false;
-            }
-            return p.get();
+        const match_record *end(std::size_t document) const {
+            return d_records.data() + d_offsets[document + 1];
         }
 
-        template<typename iteratortype>
-        void map(const iteratortype &begin, const iteratortype &end, const std::function<void(std::unique_ptr<value_type> &ptr)> &setter) {
-            setter(getNodeOrCreate(begin, end)->payload);
+        std::size_t match_count(std::size_t document) const {
+            return d_offsets[document + 1] - d_offsets[document];
         }
 
-        template<typename iteratortype>
-        bool map(const iteratortype &begin, const iteratortype &end, const value_type &value) {
-            if (getNodeOrCreate(begin, end)->set_value(value)) {
-                return true;
-            }
-            return false;
+        const std::vector<match_record> &records() const {
+            return d_records;
         }
 
-        bool map(const string_type &keyword, const value_type &value) {
-            return map(keyword.begin(), keyword.end(), value);
+        const std::vector<std::size_t> &offsets() const {
+            return d_offsets;
         }
 
-        bool insert(const string_type &keyword) {
-            return map(keyword, keyword);
+        void append_document(const std::vector<match_record> &matches) {
+            d_records.insert(d_records.end(), matches.begin(), matches.end());
+            d_offsets.push_back(d_records.size());
         }
 
-        template<typename iteratortype>
-        state_ptr_type getNodeOrCreate(const iteratortype &begin, const iteratortype &end) {
-            state_ptr_type cur_state = d_root.get();
-            for (auto i = begin; i != end; ++i) {
-                cur_state = add_state(cur_state, *i);
+        // buffers for the matches of count documents in flight, see compiled_trie::collect_batch. a batch that is
+        // reused keeps them, so it stops allocating once they have grown.
+        std::vector<match_record> *lanes(std::size_t count) {
+            if (d_lanes.size() < count) {
+                d_lanes.resize(count);
             }
-            return cur_state;
+            return d_lanes.data();
         }
+    };
 
-        state_ptr_type getNodeOrCreate(const string_type &s) {
-            return getNodeOrCreate(s.begin(), s.end());
+    // storage policies of basic_trie: how states, their edge vectors and payloads are allocated. pointer<T> owns an
+    // object made by create<T>() (payloads) or create_node<T>() (states, whose members only own memory of the same
+    // storage), allocator<T> is used for the edge vectors. thread_safe tells whether several threads may create objects
+    // at the same time (basic_trie::map_sorted).
+
+    // every state, edge vector and payload is a separate heap allocation, freed one by one.
+    struct heap_storage {
+        static const bool thread_safe = true;
+
+        template<typename T>
+        using pointer = std::unique_ptr<T>;
+
+        template<typename T>
+        using allocator = std::allocator<T>;
+
+        template<typename T>
+        allocator<T> get_allocator() const {
+            return allocator<T>();
         }
 
-        template<typename iteratortype>
-        state_ptr_type getNodeNoCreate(const iteratortype &begin, const iteratortype &end) const {
-            state_ptr_type cur_state = d_root.get();
-            for (auto i = begin; i != end; ++i) {
-                cur_state = cur_state->lookupchild(*i);
-                if (!cur_state) {
-                    return 0;
-                }
-            }
-            return cur_state;
+        template<typename T, typename... Args>
+        pointer<T> create(Args &&... args) {
+            return pointer<T>(new T(std::forward<Args>(args)...));
         }
 
-        template<typename iteratortype>
-        value_type *getNoCreate(const iteratortype &begin, const iteratortype &end) const { // use the trie as a ordinary map...
-            state_ptr_type cur_state = getNodeNoCreate(begin, end);
-            if (cur_state) {
-                return cur_state->payload.get();
-            }
+        template<typename T, typename... Args>
+        pointer<T> create_node(Args &&... args) {
+            return create<T>(std::forward<Args>(args)...);
+        }
+
+        std::size_t memory_usage() const { // not tracked.
             return 0;
         }
+    };
 
-        value_type *getNoCreate(const string_type &s) const { // use the trie as a ordinary map...
-            return getNoCreate(s.begin(), s.end());
+    // bump allocator handing out memory from large blocks, which are only released all together. objects made in it are
+    // never destroyed individually; payloads with a non-trivial destructor are registered and destroyed at the end.
+    class arena {
+        std::vector<std::unique_ptr<char[]> > d_blocks;
+        char *d_current;
+        std::size_t d_left;
+        std::size_t d_block_size;
+        std::size_t d_allocated;
+        std::vector<std::pair<void (*)(void *), void *> > d_destructors;
+
+        template<typename T>
+        static void destroy(void *p) {
+            static_cast<T *>(p)->~T();
         }
 
-        template<typename iteratortype>
-        value_type &getOrCreate(const iteratortype &begin, const iteratortype &end) { // useful when the value_type is a container.
-            state_ptr_type cur_state = getNodeOrCreate(begin, end);
-            if (!cur_state->payload) {
-                cur_state->payload.reset(new value_type());
+    public:
+        explicit arena(std::size_t block_size) :
+                d_blocks(),
+                d_current(nullptr),
+                d_left(0),
+                d_block_size(block_size),
+                d_allocated(0),
+                d_destructors() {
+        }
+
+        arena(const arena &) = delete;
+
+        arena &operator=(const arena &) = delete;
+
+        ~arena() {
+            for (auto i = d_destructors.rbegin(); i != d_destructors.rend(); ++i) {
+                i->first(i->second);
             }
-            return *cur_state->payload;
         }
 
-        value_type &getOrCreate(const string_type &s) { // useful when the value_type is a container.
-            return getorCreate(s.begin(), s.end());
+        void *allocate(std::size_t size, std::size_t alignment) {
+            std::size_t padding = (alignment - reinterpret_cast<std::uintptr_t>(d_current) % alignment) % alignment;
+            if (padding + size > d_left) {
+                if (size + alignment > d_block_size / 4) { // large requests get a block of their own.
+                    d_blocks.push_back(std::unique_ptr<char[]>(new char[size + alignment]));
+                    d_allocated += size + alignment;
+                    char *p = d_blocks.back().get();
+                    return p + (alignment - reinterpret_cast<std::uintptr_t>(p) % alignment) % alignment;
+                }
+                d_blocks.push_back(std::unique_ptr<char[]>(new char[d_block_size]));
+                d_allocated += d_block_size;
+                d_current = d_blocks.back().get();
+                d_left = d_block_size;
+                padding = (alignment - reinterpret_cast<std::uintptr_t>(d_current) % alignment) % alignment;
+            }
+            char *p = d_current + padding;
+            d_current += padding + size;
+            d_left -= padding + size;
+            return p;
         }
 
-        template<typename iteratortype>
-        void erase(const iteratortype &begin, const iteratortype &end) const { // use the trie as a ordinary container...
-            state_ptr_type cur_state = getNodeNoCreate(begin, end);
-            if (cur_state) {
-                cur_state->payload.reset(); // cant remove the node because i dont know (cheaply) how many other nodes use this one as fail/fallback (besides that it can have children too of course)
+        template<typename T, typename... Args>
+        T *create(Args &&... args) {
+            T *p = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if (!std::is_trivially_destructible<T>::value) {
+                d_destructors.push_back(std::make_pair(&destroy<T>, static_cast<void *>(p)));
             }
+            return p;
         }
 
-        void erase(const string_type &s) const { // use the trie as a ordinary container...
-            forget(s.begin(), s.end());
+        template<typename T, typename... Args>
+        T *create_node(Args &&... args) {
+            return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
         }
 
-        struct BeginEndValue {
-            const std::size_t begin;
-            const std::size_t end;
-            const value_type &v;
+        std::size_t memory_usage() const {
+            return d_allocated + d_blocks.capacity() * sizeof(d_blocks[0]) + d_destructors.capacity() * sizeof(d_destructors[0]);
+        }
+    };
 
-            bool operator<(const BeginEndValue &o) const {
-                if (begin == o.begin) {
-                    if (end == o.end) {
-                        return v < o.v;
-                    } else {
-                        return end < o.end;
-                    }
-                } else {
-                    return begin < o.begin;
-                }
-            }
+    template<typename T>
+    class arena_allocator {
+        template<typename U>
+        friend class arena_allocator;
 
-            bool operator==(const BeginEndValue &o) const {
-                return begin == o.begin && end == o.end && v == o.v;
-            }
-        };
+        arena *d_arena;
 
-        std::vector<BeginEndValue> collect_matches(const string_type &v) {
-            return collect_matches(v.begin(), v.end());
+    public:
+        typedef T value_type;
+
+        arena_allocator() :
+                d_arena(nullptr) {
         }
 
-        template<typename iteratortype>
-        std::vector<BeginEndValue> collect_matches(const iteratortype &begin, const iteratortype &end) {
-            check_construct_failure_states();
-            size_t pos = 0;
-            state_ptr_type cur_state = d_root.get();
-            std::vector<BeginEndValue> hits;
-            for (auto i = begin; i != end; ++i) {
-                cur_state = get_state(cur_state, *i);
-                cur_state->iterate_values(pos, [&hits](const value_type &v, const std::size_t &b, const std::size_t &e) {
-                    hits.push_back(BeginEndValue{b, e, v});
-                    return true;
-                });
-                pos++;
-            }
-            return hits;
+        explicit arena_allocator(arena *a) :
+                d_arena(a) {
         }
 
-        template<typename iteratortype, typename callbackfct>
-        void iterate_matches(
-                const iteratortype &begin,
-                const iteratortype &end,
-                const callbackfct &fct) { //std::function<bool(const value_type &, const iteratortype&, const iteratortype&)>
-            check_construct_failure_states();
-            state_ptr_type cur_state = d_root.get();
-            for (auto i = begin; i != end; ++i) {
-                cur_state = get_state(cur_state, *i);
-                if (!cur_state->iterate_values(i, fct)) {
-                    return;
-                }
-            }
+        template<typename U>
+        arena_allocator(const arena_allocator<U> &o) :
+                d_arena(o.d_arena) {
         }
 
-        template<typename callbackfct>
-        void iterate_matches(const string_type &s,
-                             const callbackfct &fct) {
-            iterate_matches(s.begin(), s.end(), fct);
+        T *allocate(std::size_t n) {
+            return static_cast<T *>(d_arena->allocate(n * sizeof(T), alignof(T)));
         }
 
-        state_ptr_type get_state(state_ptr_type cur_state, CharType c) const {
-            state_ptr_type result = cur_state->next_state_no_failure(c, d_root.get());
-            while (result == nullptr) {
-                cur_state = cur_state->d_failure;
-                result = cur_state->next_state_no_failure(c, d_root.get());
-            }
-            return result;
+        void deallocate(T *, std::size_t) { // released with the arena, a growing vector leaves its old buffer behind.
         }
 
-        void check_construct_failure_states() {
-            if (!d_constructed_failure_states) {
-                construct_failure_states();
-            }
+        template<typename U>
+        bool operator==(const arena_allocator<U> &o) const {
+            return d_arena == o.d_arena;
         }
 
-        void construct_failure_states() {
-            std::queue<state_ptr_type> q; // -> breadth-first iterative deepening...
-            // root has no fail
-            for (const auto &char_depth_one_state : d_root->d_success) {
-                char_depth_one_state.second->d_failure = d_root.get();
-                q.push(char_depth_one_state.second.get());
-            }
-            d_constructed_failure_states = true;
+        template<typename U>
+        bool operator!=(const arena_allocator<U> &o) const {
+            return d_arena != o.d_arena;
+        }
+    };
 
-            while (!q.empty()) {
-                auto cur_state = q.front();
-                q.pop();
-                for (const auto &char_child : cur_state->d_success) {
-                    state_ptr_type target_state = char_child.second.get(); //cur_state->next_state(transition);
-                    q.push(target_state);
+    struct arena_delete {
+        template<typename T>
+        void operator()(T *) const {
+        }
+    };
 
-                    state_ptr_type trace_failure_state = cur_state->d_failure;
-                    while (trace_failure_state->next_state_no_failure(char_child.first, d_root.get()) == nullptr) {
-                        trace_failure_state = trace_failure_state->d_failure;
-                    }
-                    target_state->d_failure = trace_failure_state->next_state_no_failure(char_child.first, d_root.get());
-                }
+    // arena backed storage: building a trie does a handful of large allocations instead of millions of small ones, and
+    // tearing it down releases the blocks without visiting the states. the arena stays put when the trie is moved.
+    class arena_storage {
+        std::unique_ptr<arena> d_arena;
 
-            }
+    public:
+        static const bool thread_safe = false;
+
+        template<typename T>
+        using pointer = std::unique_ptr<T, arena_delete>;
+
+        template<typename T>
+        using allocator = arena_allocator<T>;
+
+        explicit arena_storage(std::size_t block_size = std::size_t(1) << 20) :
+                d_arena(new arena(block_size)) {
         }
 
-#ifndef AHO_CORASICK_NOEXTRAS
+        template<typename T>
+        allocator<T> get_allocator() const {
+            return allocator<T>(d_arena.get());
+        }
 
-        std::string toDot() const {
-            std::ostringstream oss;
-            oss << "digraph 123 { graph [rankdir=LR]; node [shape=box] " << std::endl;
-            std::queue<state_ptr_type> q;
-            q.push(d_root.get());
-            while (!q.empty()) {
-                auto cur_state = q.front();
-                q.pop();
+        template<typename T, typename... Args>
+        pointer<T> create(Args &&... args) {
+            return pointer<T>(d_arena->create<T>(std::forward<Args>(args)...));
+        }
 
+        template<typename T, typename... Args>
+        pointer<T> create_node(Args &&... args) {
+            return pointer<T>(d_arena->create_node<T>(std::forward<Args>(args)...));
+        }
 
-                oss << (std::size_t) cur_state << " [label=\"";
-                cur_state->iterate_values((std::size_t) 0, [&oss](const value_type &v, const std::size_t &, const std::size_t &) {
-                    oss << v << "\\" << "r";
-                    return true;
-                });
-                oss << "\"];" << std::endl;
-                for (const auto &char_child : cur_state->d_success) {
-                    state_ptr_type target_state = char_child.second.get();// cur_state->next(transition,d_root);
-                    q.push(target_state);
-                    oss << (std::size_t) cur_state << " -> " << (std::size_t) target_state << " [label=\"" << char_child.first << "\",color=green]" << std::endl;
-                }
-                if (cur_state->d_failure && cur_state->d_failure != d_root.get()) {
-                    oss << (std::size_t) cur_state << " -> " << (std::size_t) cur_state->d_failure << " [color=red,constraint=false];" << std::endl;
-                }
-            }
+        std::size_t memory_usage() const {
+            return d_arena->memory_usage();
+        }
+    };
 
-            oss << "}" << std::endl;
-            return oss.str();
+    template<typename CharType>
+    class sorted_transitions;
+
+    template<typename CharType, std::size_t max_table_bytes = std::size_t(16) << 20>
+    class dense_transitions;
+
+    template<typename CharType>
+    struct identity_symbols;
+
+    template<typename string_type,
+             typename value_type,
+             typename transitions = sorted_transitions<typename string_type::value_type>,
+             typename symbol_map = identity_symbols<typename string_type::value_type> >
+    class compiled_trie;
+
+    template<typename automaton_type>
+    class stream_matcher;
+
+    // the begin offset of a match that ends with the symbol at offset last and is depth symbols long. iterators get
+    // their begins from a match_begin_finder.
+    inline std::size_t match_begin_of(std::size_t last, std::size_t depth) {
+        return last + 1 - depth;
+    }
+
+    // the begin iterators of the matches iterate_matches reports. random access iterators step back in O(1), other
+    // (forward) iterators are remembered for the last max_depth symbols instead of being walked back symbol by symbol.
+    template<typename iteratortype,
+            bool random_access = std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<iteratortype>::iterator_category>::value>
+    class match_begin_finder {
+    public:
+        explicit match_begin_finder(std::size_t) {
         }
 
-#endif
+        void push(const iteratortype &) { // the symbol about to be consumed.
+        }
+
+        iteratortype begin(const iteratortype &posend, std::size_t depth) const {
+            return posend - static_cast<typename std::iterator_traits<iteratortype>::difference_type>(depth);
+        }
+    };
+
+    template<typename iteratortype>
+    class match_begin_finder<iteratortype, false> {
+        std::vector<iteratortype> d_history; // ring buffer of the last consumed symbols.
+        std::size_t d_count;
+
+    public:
+        explicit match_begin_finder(std::size_t max_depth) :
+                d_history(max_depth + 1),
+                d_count(0) {
+        }
+
+        void push(const iteratortype &i) {
+            d_history[d_count++ % d_history.size()] = i;
+        }
 
+        iteratortype begin(const iteratortype &, std::size_t depth) const {
+            return d_history[(d_count - depth) % d_history.size()];
+        }
     };
 
+    // class state
+    template<typename string_type, typename value_type, typename storage_type = heap_storage>
+    class state {
+    public:
+        using CharType = typename string_type::value_type;
+        typedef state<string_type, value_type, storage_type> *ptr;
+        typedef typename storage_type::template pointer<state<string_type, value_type, storage_type> > unique_ptr;
+        typedef typename storage_type::template pointer<value_type> payload_ptr;
+        typedef std::pair<CharType, unique_ptr> success_entry;
+        typedef typename storage_type::template allocator<success_entry> success_allocator;
+        typedef string_type &string_ref_type;
+        typedef std::vector<ptr> state_collection;
+        typedef std::vector<CharType> transition_collection;
+
+        std::vector<success_entry, success_allocator> d_success;
+        ptr d_failure;
+        ptr d_output; // nearest state on the failure chain (excluding this one) with a payload: the next shorter match.
+        payload_ptr payload; // every pattern gets only a single payload (value, whatever the pattern matches to), the submatches that end at the current position are failure-nodes of this node.
+        std::size_t depth; // not needed for the actual algo.
+        std::uint32_t pattern_id; // insertion order of the payload, the priority for match_kind::leftmost_first.
+        std::uint32_t leftmost_index; // of its entry in the leftmost links of the trie, while those are built.
+
+        state(const std::size_t depth_ = 0, const success_allocator &allocator = success_allocator()) :
+                d_success(allocator),
+                d_failure(nullptr),
+                d_output(nullptr),
+                depth(depth_),
+                pattern_id(0),
+                leftmost_index(0) {
+        }
+
+        ~state() { // takes the subtree apart iteratively, a long pattern would overflow the stack otherwise.
+            if (d_success.empty()) {
+                return;
+            }
+            std::vector<unique_ptr> pending;
+            for (auto &char_child : d_success) {
+                pending.push_back(std::move(char_child.second));
+            }
+            while (!pending.empty()) {
+                unique_ptr s = std::move(pending.back());
+                pending.pop_back();
+                for (auto &char_child : s->d_success) {
+                    pending.push_back(std::move(char_child.second));
+                }
+                s->d_success.clear(); // destroyed at the end of the iteration, without children.
+            }
+        }
+
+        ptr lookupchild(const CharType &character) const {
+            return getNoCreateOrderedUniqueKV(d_success, character).get();
+        }
+
+        ptr next_state_no_failure(const CharType &c, ptr root) const {
+            auto ret = lookupchild(c);
+            if (ret == nullptr && this == root) {
+                return root;
+            }
+            return ret;
+        }
+
+        bool set_value(const value_type &v, storage_type &storage) {
+            if (payload.get() && *payload.get() == v) {
+                return false;
+            }
+            payload = storage.template create<value_type>(v);
+            return true;
+        }
+
+        // the states whose pattern ends here: this one if it has a payload, then the output chain. a state without
+        // any match costs two null checks.
+        ptr first_output() {
+            return payload ? this : d_output;
+        }
+
+        template<typename callbackfct>
+        bool iterate_values(std::size_t pos,
+                            const callbackfct &fct) {
+            for (ptr s = first_output(); s; s = s->d_output) {
+                if (!fct(*s->payload, match_begin_of(pos, s->depth), pos + 1)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    // holds the automaton readers currently scan with. a writer builds (or compiles) a new automaton on the side and
+    // publishes it in one atomic swap; readers take a snapshot per scan and keep the old automaton alive until they drop
+    // it, so the scan itself never takes a lock.
+    template<typename automaton_type>
+    class published_automaton {
+    public:
+        typedef std::shared_ptr<const automaton_type> snapshot_type;
+
+    private:
+        snapshot_type d_current;
+
+    public:
+        published_automaton() :
+                d_current(std::make_shared<automaton_type>()) {
+        }
+
+        explicit published_automaton(snapshot_type initial) :
+                d_current(std::move(initial)) {
+        }
+
+        snapshot_type snapshot() const {
+            return std::atomic_load(&d_current);
+        }
+
+        void publish(snapshot_type next) {
+            std::atomic_store(&d_current, std::move(next));
+        }
+
+        void publish(automaton_type &&next) {
+            publish(std::make_shared<const automaton_type>(std::move(next)));
+        }
+    };
+
+    // cuts [0, size) in chunks and runs scan_chunk(scan_begin, chunk_begin, chunk_end, hits) for each of them on a pool of
+    // threads. every chunk is scanned from overlap (max_depth - 1) symbols before its start, so the automaton is in the
+    // right state at chunk_begin; scan_chunk keeps only the hits ending after chunk_begin. concatenating the chunk
+    // results in order then gives exactly the sequential result.
+    template<typename BeginEndValue, typename chunkfct>
+    std::vector<BeginEndValue> parallel_scan_chunks(std::size_t size,
+                                                    std::size_t overlap,
+                                                    std::size_t threads,
+                                                    std::size_t max_chunk_size,
+                                                    const chunkfct &scan_chunk) {
+        const std::size_t min_chunk_size = 1 << 16;
+        if (threads == 0) {
+            threads = std::max<unsigned>(1, std::thread::hardware_concurrency());
+        }
+        std::size_t chunks = std::min(threads * 4, size / std::max(min_chunk_size, 4 * overlap) + 1);
+        chunks = std::max(chunks, size / max_chunk_size + 1);
+        threads = std::min(threads, chunks);
+        const std::size_t chunk_size = size / chunks + 1;
+
+        std::vector<std::vector<BeginEndValue> > results(chunks);
+        std::atomic<std::size_t> next_chunk(0);
+        auto worker = [&]() {
+            for (std::size_t c = next_chunk++; c < chunks; c = next_chunk++) {
+                const std::size_t chunk_begin = std::min(size, c * chunk_size);
+                const std::size_t chunk_end = std::min(size, chunk_begin + chunk_size);
+                scan_chunk(chunk_begin - std::min(chunk_begin, overlap), chunk_begin, chunk_end, results[c]);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (std::size_t t = 1; t < threads; ++t) {
+            pool.push_back(std::thread(worker));
+        }
+        worker();
+        for (auto &t : pool) {
+            t.join();
+        }
+
+        std::size_t total = 0;
+        for (const auto &r : results) {
+            total += r.size();
+        }
+        std::vector<BeginEndValue> hits;
+        hits.reserve(total);
+        for (const auto &r : results) {
+            for (const auto &hit : r) {
+                hits.push_back(hit);
+            }
+        }
+        return hits;
+    }
+
+    // runs fct(range begin, range end, range number) for [0, count) cut in one range per thread (0: one per core).
+    template<typename rangefct>
+    void parallel_for_ranges(std::size_t count, std::size_t threads, const rangefct &fct) {
+        if (threads == 0) {
+            threads = std::max<unsigned>(1, std::thread::hardware_concurrency());
+        }
+        threads = std::max<std::size_t>(1, std::min(threads, count));
+        const std::size_t range_size = count / threads + (count % threads != 0);
+        std::vector<std::thread> pool;
+        for (std::size_t t = 1; t < threads; ++t) {
+            pool.push_back(std::thread([&fct, t, range_size, count]() {
+                fct(std::min(count, t * range_size), std::min(count, (t + 1) * range_size), t);
+            }));
+        }
+        fct(0, std::min(count, range_size), std::size_t(0));
+        for (auto &t : pool) {
+            t.join();
+        }
+    }
+
+    // scans the random access range [begin, end) on several threads (0: one per core), same result as collect_matches.
+    // the automaton must not be modified meanwhile.
+    template<typename automaton_type, typename iteratortype>
+    std::vector<typename automaton_type::BeginEndValue> parallel_collect_matches(const automaton_type &automaton,
+                                                                                 const iteratortype &begin,
+                                                                                 const iteratortype &end,
+                                                                                 std::size_t threads) {
+        typedef typename automaton_type::BeginEndValue BeginEndValue;
+        typedef typename automaton_type::payload_type value_type;
+        return parallel_scan_chunks<BeginEndValue>(
+                static_cast<std::size_t>(end - begin),
+                automaton.max_depth() ? automaton.max_depth() - 1 : 0,
+                threads,
+                std::size_t(-1),
+                [&](std::size_t scan_begin, std::size_t chunk_begin, std::size_t chunk_end, std::vector<BeginEndValue> &hits) {
+                    auto cur_state = automaton.root();
+                    std::size_t pos = scan_begin;
+                    automaton.scan(cur_state, pos, begin + scan_begin, begin + chunk_end,
+                                   [&hits, chunk_begin](const value_type &v, std::size_t b, std::size_t e) {
+                                       if (e > chunk_begin) {
+                                           hits.push_back(BeginEndValue{b, e, v});
+                                       }
+                                       return true;
+                                   });
+                });
+    }
+
+    // which matches a scan reports.
+    enum class match_kind {
+        overlapping, // every occurrence of every pattern, like collect_matches without a kind.
+        non_overlapping, // the longest match that ends first, then the scan restarts behind it.
+        leftmost_first, // the match that starts first, of those the pattern mapped first. continues behind it.
+        leftmost_longest // the match that starts first, of those the longest. continues behind it.
+    };
+
+    // what the leftmost kinds know per state (see scan_leftmost_matches), none of them is the root. the scan decides on
+    // the match starting at a position once the automaton leaves the last state that still starts there; these links
+    // find the states it leaves in time proportional to those that start a match, so the input is read only once.
+    template<typename state_id_type>
+    struct leftmost_links {
+        state_id_type longest; // the deepest state with a payload on the trie path to this one (this one included).
+        state_id_type first; // the state with the lowest pattern id on that path.
+        state_id_type prefix_link; // the next state on the failure chain (this one excluded) with a longest.
+        state_id_type gap; // entered from the parent, the states of its failure chain from gap on (see below) are left.
+        state_id_type gap_next; // the next state on the failure chain (this one excluded) with a gap.
+    };
+
+    // the links of s from those of its parent and of its failure state, which have to be done already. the failure chain
+    // of the parent continues with the parents of the failure chain of s, the states in between lack the label of s and
+    // are left when s is entered: gap is the first of them with a longest, down to the depth of the failure state of s.
+    template<typename state_id_type, typename linksfct, typename depthfct, typename priorityfct>
+    leftmost_links<state_id_type> derive_leftmost_links(state_id_type s,
+                                                        state_id_type parent,
+                                                        state_id_type failure,
+                                                        bool has_payload,
+                                                        state_id_type none,
+                                                        const linksfct &links_of,
+                                                        const depthfct &depth_of,
+                                                        const priorityfct &priority_of) {
+        const leftmost_links<state_id_type> &p = links_of(parent);
+        const leftmost_links<state_id_type> &f = links_of(failure);
+        leftmost_links<state_id_type> result;
+        result.longest = has_payload ? s : p.longest;
+        result.first = has_payload && (p.first == none || priority_of(s) < priority_of(p.first)) ? s : p.first;
+        result.prefix_link = f.longest != none ? failure : f.prefix_link;
+        result.gap = p.prefix_link != none && depth_of(p.prefix_link) >= depth_of(failure) ? p.prefix_link : none;
+        result.gap_next = f.gap != none ? failure : f.gap_next;
+        return result;
+    }
+
+    // the matches a leftmost scan holds back until every position before them is decided, per start position: at most
+    // max_depth + 1 consecutive positions are pending, so they share a ring. the ring of the thread is reused between
+    // scans (steady state scanning does not allocate); a scan started from the callback of another one gets its own.
+    template<typename value_type>
+    class leftmost_window {
+        struct entry {
+            const value_type *v; // nullptr: no match starts there.
+            std::size_t length;
+        };
+
+        struct shared_ring {
+            std::vector<entry> entries;
+            bool busy;
+        };
+
+        static shared_ring &thread_ring() {
+            static thread_local shared_ring ring = shared_ring{std::vector<entry>(), false};
+            return ring;
+        }
+
+        std::vector<entry> d_own;
+        std::vector<entry> *d_entries;
+        std::size_t d_mask;
+        std::size_t d_decided; // the positions before it are reported or passed over.
+        std::size_t d_next; // the first position a match may start at, behind the last one reported.
+        std::size_t d_held_end; // the positions from it on hold nothing.
+
+        entry &at(std::size_t b) {
+            return (*d_entries)[b & d_mask];
+        }
+
+    public:
+        explicit leftmost_window(std::size_t max_depth) :
+                d_own(),
+                d_entries(&d_own),
+                d_mask(0),
+                d_decided(0),
+                d_next(0),
+                d_held_end(0) {
+            std::size_t size = 1;
+            while (size <= max_depth) {
+                size *= 2;
+            }
+            d_mask = size - 1;
+            shared_ring &ring = thread_ring();
+            if (!ring.busy) {
+                ring.busy = true;
+                d_entries = &ring.entries;
+            }
+            if (d_entries->size() < size) {
+                d_entries->resize(size, entry{nullptr, 0});
+            }
+        }
+
+        leftmost_window(const leftmost_window &) = delete;
+
+        leftmost_window &operator=(const leftmost_window &) = delete;
+
+        ~leftmost_window() { // a scan that stopped early leaves the ring clean for the next one.
+            for (std::size_t b = d_decided; b < d_held_end; ++b) {
+                at(b).v = nullptr;
+            }
+            if (d_entries != &d_own) {
+                thread_ring().busy = false;
+            }
+        }
+
+        void hold(std::size_t b, const value_type &v, std::size_t length) {
+            at(b) = entry{&v, length};
+            d_held_end = std::max(d_held_end, b + 1);
+        }
+
+        // nothing is held from the decided positions up to b, the scan skipped there.
+        void skip_to(std::size_t b) {
+            d_decided = b;
+        }
+
+        // reports fct(value, begin, end) for the held matches starting before until that do not overlap an earlier one.
+        template<typename callbackfct>
+        bool decide(std::size_t until, const callbackfct &fct) {
+            for (; d_decided < until; ++d_decided) {
+                entry &e = at(d_decided);
+                if (!e.v) {
+                    continue;
+                }
+                const value_type *v = e.v;
+                e.v = nullptr;
+                if (d_decided >= d_next) {
+                    d_next = d_decided + e.length;
+                    AHO_CORASICK_COUNT(matches, 1);
+                    if (!fct(*v, d_decided, d_next)) {
+                        ++d_decided;
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+    };
+
+    // the longest match that ends first, then the scan restarts from the root behind it.
+    template<typename automaton_type, typename iteratortype, typename callbackfct>
+    bool scan_non_overlapping_matches(const automaton_type &automaton,
+                                      const iteratortype &begin,
+                                      const iteratortype &end,
+                                      const callbackfct &fct) {
+        typedef typename automaton_type::payload_type value_type;
+        auto cur_state = automaton.root();
+        std::size_t pos = 0;
+        for (auto i = begin; i != end;) {
+            if (cur_state == automaton.root()) {
+                pos += automaton.skip_to_candidate(i, end);
+                if (i == end) {
+                    break;
+                }
+            }
+            cur_state = automaton.get_state(cur_state, *i);
+            ++i;
+            ++pos;
+            const value_type *v;
+            std::size_t depth, priority;
+            if (automaton.longest_output(cur_state, v, depth, priority)) {
+                AHO_CORASICK_COUNT(matches, 1);
+                cur_state = automaton.root();
+                if (!fct(*v, pos - depth, pos)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // the leftmost kinds in one pass. a position p is still open while the text from p on spells a state of the failure
+    // chain of the current state; once a symbol leaves that state, the longest (or first mapped) pattern starting at p
+    // is known: the longest or first link of the state. so every step holds the match of each state with such a link
+    // that it leaves, and reports the held matches before the start of the new state, left to right, skipping those that
+    // overlap the previous one. the states left are those of the old failure chain at least as deep as the new state,
+    // and the gaps of the failure chain of the new state.
+    template<typename automaton_type, typename iteratortype, typename callbackfct>
+    bool scan_leftmost_matches(const automaton_type &automaton,
+                               match_kind kind,
+                               const iteratortype &begin,
+                               const iteratortype &end,
+                               const callbackfct &fct) {
+        typedef typename automaton_type::payload_type value_type;
+        typedef decltype(automaton.root()) state_id_type;
+        automaton.check_construct_leftmost_links();
+        const state_id_type none = automaton.null_state();
+        leftmost_window<value_type> window(automaton.max_depth());
+        // holds the matches of the states from t on along the prefix links, down to min_depth. they end at e.
+        auto hold_from = [&](state_id_type t, std::size_t min_depth, std::size_t e) {
+            for (; t != none && automaton.state_depth(t) >= min_depth; t = automaton.leftmost(t).prefix_link) {
+                const state_id_type m = kind == match_kind::leftmost_longest ? automaton.leftmost(t).longest : automaton.leftmost(t).first;
+                window.hold(e - automaton.state_depth(t), automaton.state_payload(m), automaton.state_depth(m));
+            }
+        };
+        auto first_prefix = [&](state_id_type s) {
+            return automaton.leftmost(s).longest != none ? s : automaton.leftmost(s).prefix_link;
+        };
+        auto cur_state = automaton.root();
+        std::size_t pos = 0;
+        for (auto i = begin; i != end;) {
+            if (cur_state == automaton.root()) {
+                pos += automaton.skip_to_candidate(i, end);
+                window.skip_to(pos);
+                if (i == end) {
+                    break;
+                }
+            }
+            const state_id_type next = automaton.get_state(cur_state, *i);
+            ++i;
+            const std::size_t depth = automaton.state_depth(next);
+            if (depth <= automaton.state_depth(cur_state)) {
+                hold_from(first_prefix(cur_state), depth, pos);
+            }
+            const leftmost_links<state_id_type> &links = automaton.leftmost(next);
+            for (state_id_type y = links.gap != none ? next : links.gap_next; y != none; y = automaton.leftmost(y).gap_next) {
+                hold_from(automaton.leftmost(y).gap, automaton.state_depth(automaton.state_failure(y)), pos);
+            }
+            cur_state = next;
+            ++pos;
+            if (!window.decide(pos - depth, fct)) {
+                return false;
+            }
+        }
+        hold_from(first_prefix(cur_state), 0, pos);
+        return window.decide(pos, fct);
+    }
+
+    // reports fct(value, begin offset, end offset) for the matches of kind in [begin, end), returns false when fct asked
+    // to stop. no kind builds the list of overlapping matches or reads the input twice, so input iterators do for all.
+    template<typename automaton_type, typename iteratortype, typename callbackfct>
+    bool scan_matches(const automaton_type &automaton,
+                      match_kind kind,
+                      const iteratortype &begin,
+                      const iteratortype &end,
+                      const callbackfct &fct) {
+        automaton.check_construct_failure_states();
+        if (kind == match_kind::overlapping) {
+            auto cur_state = automaton.root();
+            std::size_t pos = 0;
+            return automaton.scan(cur_state, pos, begin, end, fct);
+        }
+        if (kind == match_kind::non_overlapping) {
+            return scan_non_overlapping_matches(automaton, begin, end, fct);
+        }
+        return scan_leftmost_matches(automaton, kind, begin, end, fct);
+    }
+
+    // continues a scan from cur_state/pos over the next part of a stream, like the automaton's scan(). only overlapping
+    // and non_overlapping matches can be found this way. the leftmost kinds hold matches back until the positions before
+    // them are decided, more than cur_state and pos carry from one part to the next, and throw std::invalid_argument.
+    template<typename automaton_type, typename state_id_type, typename iteratortype, typename callbackfct>
+    bool scan_stream(const automaton_type &automaton,
+                     match_kind kind,
+                     state_id_type &cur_state,
+                     std::size_t &pos,
+                     const iteratortype &begin,
+                     const iteratortype &end,
+                     const callbackfct &fct) {
+        typedef typename automaton_type::payload_type value_type;
+        if (kind == match_kind::overlapping) {
+            return automaton.scan(cur_state, pos, begin, end, fct);
+        }
+        if (kind != match_kind::non_overlapping) {
+            throw std::invalid_argument("aho_corasick::scan_stream: the leftmost match kinds cannot be found in a stream");
+        }
+        automaton.check_construct_failure_states();
+        for (auto i = begin; i != end;) {
+            if (cur_state == automaton.root()) {
+                pos += automaton.skip_to_candidate(i, end);
+                if (i == end) {
+                    break;
+                }
+            }
+            cur_state = automaton.get_state(cur_state, *i);
+            ++i;
+            ++pos;
+            const value_type *v;
+            std::size_t depth, priority;
+            if (automaton.longest_output(cur_state, v, depth, priority)) {
+                AHO_CORASICK_COUNT(matches, 1);
+                cur_state = automaton.root();
+                if (!fct(*v, pos - depth, pos)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // the scan loop of the queries below: calls step(state, end offset) for every state with an output, until step
+    // returns false (then so does scan_outputs). no match positions or payload references are built.
+    template<typename automaton_type, typename iteratortype, typename stepfct>
+    bool scan_outputs(const automaton_type &automaton, const iteratortype &begin, const iteratortype &end, const stepfct &step) {
+        automaton.check_construct_failure_states();
+        auto cur_state = automaton.root();
+        std::size_t pos = 0;
+        for (auto i = begin; i != end; ++i) {
+            if (cur_state == automaton.root()) {
+                pos += automaton.skip_to_candidate(i, end);
+                if (i == end) {
+                    break;
+                }
+            }
+            cur_state = automaton.get_state(cur_state, *i);
+            ++pos;
+            if (automaton.has_output(cur_state) && !step(cur_state, pos)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // stops at the first position where any pattern ends.
+    template<typename automaton_type, typename iteratortype>
+    bool contains_any(const automaton_type &automaton, const iteratortype &begin, const iteratortype &end) {
+        typedef decltype(automaton.root()) state_id_type;
+        return !scan_outputs(automaton, begin, end, [](state_id_type, std::size_t) {
+            return false;
+        });
+    }
+
+    // the match that ends first (the longest of those), nullptr if there is none. stops scanning there.
+    template<typename automaton_type, typename iteratortype>
+    const typename automaton_type::payload_type *find_first(const automaton_type &automaton,
+                                                            const iteratortype &begin,
+                                                            const iteratortype &end,
+                                                            std::size_t *match_begin = nullptr,
+                                                            std::size_t *match_end = nullptr) {
+        typedef decltype(automaton.root()) state_id_type;
+        const typename automaton_type::payload_type *result = nullptr;
+        scan_outputs(automaton, begin, end, [&](state_id_type cur_state, std::size_t pos) {
+            std::size_t depth = 0, priority;
+            automaton.longest_output(cur_state, result, depth, priority);
+            AHO_CORASICK_COUNT(matches, 1);
+            if (match_begin) {
+                *match_begin = pos - depth;
+            }
+            if (match_end) {
+                *match_end = pos;
+            }
+            return false;
+        });
+        return result;
+    }
+
+    // the number of (overlapping) matches, same as collect_matches(begin, end).size().
+    template<typename automaton_type, typename iteratortype>
+    std::size_t count_matches(const automaton_type &automaton, const iteratortype &begin, const iteratortype &end) {
+        typedef decltype(automaton.root()) state_id_type;
+        std::size_t count = 0;
+        scan_outputs(automaton, begin, end, [&](state_id_type cur_state, std::size_t) {
+            automaton.iterate_pattern_ids(cur_state, [&count](std::size_t) {
+                ++count;
+            });
+            return true;
+        });
+        return count;
+    }
+
+    // per pattern id (see pattern_id_count) the number of matches, histogram is overwritten but keeps its capacity.
+    // returns the total.
+    template<typename automaton_type, typename iteratortype>
+    std::size_t count_pattern_matches(const automaton_type &automaton,
+                                      const iteratortype &begin,
+                                      const iteratortype &end,
+                                      std::vector<std::size_t> &histogram) {
+        typedef decltype(automaton.root()) state_id_type;
+        histogram.assign(automaton.pattern_id_count(), 0);
+        std::size_t count = 0;
+        scan_outputs(automaton, begin, end, [&](state_id_type cur_state, std::size_t) {
+            automaton.iterate_pattern_ids(cur_state, [&](std::size_t id) {
+                ++histogram[id];
+                ++count;
+            });
+            return true;
+        });
+        return count;
+    }
+
+#ifndef AHO_CORASICK_NOEXTRAS
+
+    // utf-8 encoding of a string of code points, or of utf-16 when its characters are 16 bits wide. throws
+    // std::invalid_argument on anything that is no unicode scalar value, such as a lone surrogate.
+    template<typename wide_string_type>
+    std::string to_utf8(const wide_string_type &s) {
+        typedef typename std::make_unsigned<typename wide_string_type::value_type>::type unsigned_char_type;
+        std::string result;
+        result.reserve(s.size());
+        for (std::size_t i = 0; i < s.size(); ++i) {
+            std::uint32_t c = static_cast<unsigned_char_type>(s[i]);
+            if (sizeof(unsigned_char_type) == 2 && c >= 0xd800 && c < 0xdc00 && i + 1 < s.size()) {
+                const std::uint32_t low = static_cast<unsigned_char_type>(s[i + 1]);
+                if (low >= 0xdc00 && low < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                    ++i;
+                }
+            }
+            if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+                throw std::invalid_argument("aho_corasick::to_utf8: not a unicode scalar value");
+            }
+            if (c < 0x80) {
+                result += static_cast<char>(c);
+            } else if (c < 0x800) {
+                result += static_cast<char>(0xc0 | (c >> 6));
+                result += static_cast<char>(0x80 | (c & 0x3f));
+            } else if (c < 0x10000) {
+                result += static_cast<char>(0xe0 | (c >> 12));
+                result += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+                result += static_cast<char>(0x80 | (c & 0x3f));
+            } else {
+                result += static_cast<char>(0xf0 | (c >> 18));
+                result += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+                result += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+                result += static_cast<char>(0x80 | (c & 0x3f));
+            }
+        }
+        return result;
+    }
+
+    inline bool starts_utf8_character(char byte) { // anything but a continuation byte.
+        return (static_cast<unsigned char>(byte) & 0xc0) != 0x80;
+    }
+
+    // scan_matches over utf-8 input with a byte automaton (see basic_trie::compile_utf8), fct(value, begin, end) gets
+    // character offsets instead of byte offsets. nothing is decoded: the characters are counted between matches only,
+    // so input without matches costs no more than the plain scan. needs random access iterators.
+    template<typename automaton_type, typename iteratortype, typename callbackfct>
+    bool scan_utf8(const automaton_type &automaton,
+                   match_kind kind,
+                   const iteratortype &begin,
+                   const iteratortype &end,
+                   const callbackfct &fct) {
+        typedef typename automaton_type::payload_type value_type;
+        std::size_t counted = 0, characters = 0; // the characters in the first counted bytes.
+        return scan_matches(automaton, kind, begin, end, [&](const value_type &v, std::size_t b, std::size_t e) {
+            for (; counted < e; ++counted) { // every kind reports the matches in order of their end.
+                characters += starts_utf8_character(begin[counted]);
+            }
+            std::size_t length = 0;
+            for (std::size_t k = b; k < e; ++k) {
+                length += starts_utf8_character(begin[k]);
+            }
+            return fct(v, characters - length, characters);
+        });
+    }
+
+    // the matches of kind with character offsets, the same as a wide automaton finds in the decoded input.
+    template<typename automaton_type, typename iteratortype>
+    std::vector<typename automaton_type::BeginEndValue> collect_utf8_matches(const automaton_type &automaton,
+                                                                             const iteratortype &begin,
+                                                                             const iteratortype &end,
+                                                                             match_kind kind = match_kind::overlapping) {
+        typedef typename automaton_type::BeginEndValue BeginEndValue;
+        typedef typename automaton_type::payload_type value_type;
+        std::vector<BeginEndValue> hits;
+        scan_utf8(automaton, kind, begin, end, [&hits](const value_type &v, std::size_t b, std::size_t e) {
+            hits.push_back(BeginEndValue{b, e, v});
+            return true;
+        });
+        return hits;
+    }
+
+#endif
+
+    // the shape and size of a basic_trie, see basic_trie::statistics. the histograms are indexed by the measured value.
+    struct trie_statistics {
+        std::size_t states;
+        std::size_t transitions;
+        std::size_t patterns; // states with a payload.
+        std::vector<std::size_t> fan_out; // states per number of outgoing transitions.
+        std::vector<std::size_t> depth; // states per depth.
+        std::vector<std::size_t> failure_chain; // states per number of failure links to the root.
+        std::size_t state_bytes; // the state objects.
+        std::size_t transition_bytes; // the capacity of the transition vectors.
+        std::size_t payload_bytes; // the payload objects, not what they own themselves.
+        std::size_t storage_bytes; // what the storage policy reserved (it holds all of the above), 0 when not tracked.
+        std::size_t link_bytes; // the side tables of incremental updates (an estimate) and the leftmost kinds, on the heap.
+
+        trie_statistics() :
+                states(0),
+                transitions(0),
+                patterns(0),
+                state_bytes(0),
+                transition_bytes(0),
+                payload_bytes(0),
+                storage_bytes(0),
+                link_bytes(0) {
+        }
+
+        std::size_t total_bytes() const {
+            return std::max(storage_bytes, state_bytes + transition_bytes + payload_bytes) + link_bytes;
+        }
+
+        // the average number of failure links a mismatch may follow.
+        double average_failure_chain() const {
+            std::size_t sum = 0;
+            for (std::size_t length = 0; length < failure_chain.size(); ++length) {
+                sum += length * failure_chain[length];
+            }
+            return states ? static_cast<double>(sum) / states : 0;
+        }
+    };
+
+    // symbol_map (see identity_symbols) is applied to every symbol of a pattern when it is mapped and to every scanned
+    // symbol, the states only hold mapped symbols.
+    template<typename string_type,
+             typename value_type,
+             typename storage_type = heap_storage,
+             typename symbol_map = identity_symbols<typename string_type::value_type> >
+    class basic_trie {
+    public:
+        using CharType = typename string_type::value_type;
+
+        typedef string_type pattern_type;
+        typedef value_type payload_type;
+        typedef symbol_map symbol_map_type;
+        typedef string_type &string_ref_type;
+        typedef state<string_type, value_type, storage_type> state_type;
+        typedef state<string_type, value_type, storage_type> *state_ptr_type;
+
+    private:
+        storage_type d_storage; // declared first: it has to outlive the states.
+        typename state_type::unique_ptr d_root;
+        mutable std::atomic<bool> d_constructed_failure_states; // failure links are built lazily by the first (const) scan.
+        mutable std::mutex d_construct_mutex;
+        std::size_t d_max_depth;
+        std::size_t d_next_pattern_id;
+        bool d_incremental;
+        symbol_map d_symbols;
+
+        // with incremental updates, the trie parent and the failure tree of every state but the root. kept on the side,
+        // so the states stay small when they are not used.
+        struct incremental_links {
+            state_ptr_type parent;
+            CharType label; // of the edge from the parent.
+            state_ptr_type failure_children; // the states failing to this one, all of them share its label.
+            state_ptr_type failure_next;
+            state_ptr_type failure_prev;
+        };
+
+        mutable std::unordered_map<state_ptr_type, incremental_links> d_links;
+        mutable std::map<CharType, state_ptr_type> d_root_failure_children; // per label, the states failing to the root.
+
+        // built by the first leftmost scan after a change, in breadth-first order (see leftmost_index).
+        mutable std::atomic<bool> d_built_leftmost_links;
+        mutable std::vector<leftmost_links<state_ptr_type> > d_leftmost;
+
+    public:
+        explicit basic_trie(storage_type storage = storage_type(), symbol_map symbols = symbol_map()) :
+                d_storage(std::move(storage)),
+                d_root(d_storage.template create_node<state_type>(0, d_storage.template get_allocator<typename state_type::success_entry>())),
+                d_constructed_failure_states(false),
+                d_construct_mutex(),
+                d_max_depth(0),
+                d_next_pattern_id(0),
+                d_incremental(false),
+                d_symbols(std::move(symbols)),
+                d_links(),
+                d_root_failure_children(),
+                d_built_leftmost_links(false),
+                d_leftmost() {
+        }
+
+        basic_trie(basic_trie &&o) :
+                d_storage(std::move(o.d_storage)),
+                d_root(std::move(o.d_root)),
+                d_constructed_failure_states(o.d_constructed_failure_states.load()),
+                d_construct_mutex(),
+                d_max_depth(o.d_max_depth),
+                d_next_pattern_id(o.d_next_pattern_id),
+                d_incremental(o.d_incremental),
+                d_symbols(std::move(o.d_symbols)),
+                d_links(std::move(o.d_links)),
+                d_root_failure_children(std::move(o.d_root_failure_children)),
+                d_built_leftmost_links(o.d_built_leftmost_links.load()),
+                d_leftmost(std::move(o.d_leftmost)) {
+        }
+
+        basic_trie &operator=(basic_trie &&o) {
+            d_root = std::move(o.d_root);
+            d_storage = std::move(o.d_storage);
+            d_constructed_failure_states = o.d_constructed_failure_states.load();
+            d_max_depth = o.d_max_depth;
+            d_next_pattern_id = o.d_next_pattern_id;
+            d_incremental = o.d_incremental;
+            d_symbols = std::move(o.d_symbols);
+            d_links = std::move(o.d_links);
+            d_root_failure_children = std::move(o.d_root_failure_children);
+            d_built_leftmost_links = o.d_built_leftmost_links.load();
+            d_leftmost = std::move(o.d_leftmost);
+            return *this;
+        }
+
+        std::size_t max_depth() const { // length of the longest pattern (erase does not lower it).
+            return d_max_depth;
+        }
+
+        state_ptr_type root() const {
+            return d_root.get();
+        }
+
+        storage_type &storage() { // to create payloads for map(begin, end, setter).
+            return d_storage;
+        }
+
+        const symbol_map &symbols() const {
+            return d_symbols;
+        }
+
+        state_ptr_type add_state(state_ptr_type cur_state, const CharType &character) {
+            const CharType symbol = d_symbols(character);
+            auto &p = getOrCreateOrderedUniqueKV(cur_state->d_success, symbol);
+            if (!p.get()) {
+                p = create_child(cur_state);
+                if (d_incremental) {
+                    link_new_state(p.get(), cur_state, symbol);
+                } else {
+                    d_constructed_failure_states = false;
+                }
+                d_max_depth = std::max(d_max_depth, cur_state->depth + 1);
+            }
+            return p.get();
+        }
+
+        template<typename iteratortype>
+        void map(const iteratortype &begin, const iteratortype &end, const std::function<void(typename state_type::payload_ptr &ptr)> &setter) {
+            state_ptr_type node = getNodeOrCreate(begin, end);
+            const bool had_payload = node->payload.get() != nullptr;
+            setter(node->payload);
+            payload_changed(node, had_payload);
+        }
+
+        template<typename iteratortype>
+        bool map(const iteratortype &begin, const iteratortype &end, const value_type &value) {
+            state_ptr_type node = getNodeOrCreate(begin, end);
+            const bool had_payload = node->payload.get() != nullptr;
+            if (node->set_value(value, d_storage)) {
+                payload_changed(node, had_payload);
+                return true;
+            }
+            return false;
+        }
+
+        bool map(const string_type &keyword, const value_type &value) {
+            return map(keyword.begin(), keyword.end(), value);
+        }
+
+        bool insert(const string_type &keyword) {
+            return map(keyword, keyword);
+        }
+
+        template<typename iteratortype>
+        state_ptr_type getNodeOrCreate(const iteratortype &begin, const iteratortype &end) {
+            state_ptr_type cur_state = d_root.get();
+            for (auto i = begin; i != end; ++i) {
+                cur_state = add_state(cur_state, *i);
+            }
+            return cur_state;
+        }
+
+        state_ptr_type getNodeOrCreate(const string_type &s) {
+            return getNodeOrCreate(s.begin(), s.end());
+        }
+
+        template<typename iteratortype>
+        state_ptr_type getNodeNoCreate(const iteratortype &begin, const iteratortype &end) const {
+            state_ptr_type cur_state = d_root.get();
+            for (auto i = begin; i != end; ++i) {
+                cur_state = cur_state->lookupchild(d_symbols(*i));
+                if (!cur_state) {
+                    return 0;
+                }
+            }
+            return cur_state;
+        }
+
+        template<typename iteratortype>
+        value_type *getNoCreate(const iteratortype &begin, const iteratortype &end) const { // use the trie as a ordinary map...
+            state_ptr_type cur_state = getNodeNoCreate(begin, end);
+            if (cur_state) {
+                return cur_state->payload.get();
+            }
+            return 0;
+        }
+
+        value_type *getNoCreate(const string_type &s) const { // use the trie as a ordinary map...
+            return getNoCreate(s.begin(), s.end());
+        }
+
+        template<typename iteratortype>
+        value_type &getOrCreate(const iteratortype &begin, const iteratortype &end) { // useful when the value_type is a container.
+            state_ptr_type cur_state = getNodeOrCreate(begin, end);
+            if (!cur_state->payload) {
+                cur_state->payload = d_storage.template create<value_type>();
+                payload_changed(cur_state, false);
+            }
+            return *cur_state->payload;
+        }
+
+        value_type &getOrCreate(const string_type &s) { // useful when the value_type is a container.
+            return getOrCreate(s.begin(), s.end());
+        }
+
+        // removes the pattern and the states only it needed, returns whether it was there.
+        // without incremental updates, the failure and output links of the other states are only valid again after
+        // the rebuild every traversal starts with.
+        template<typename iteratortype>
+        bool erase(const iteratortype &begin, const iteratortype &end) { // use the trie as a ordinary container...
+            std::vector<std::pair<state_ptr_type, CharType> > path; // the states below the root, with their labels.
+            state_ptr_type cur_state = d_root.get();
+            for (auto i = begin; i != end; ++i) {
+                const CharType symbol = d_symbols(*i);
+                cur_state = cur_state->lookupchild(symbol);
+                if (!cur_state) {
+                    return false;
+                }
+                path.push_back(std::make_pair(cur_state, symbol));
+            }
+            if (!cur_state->payload) {
+                return false;
+            }
+            cur_state->payload.reset();
+            payload_changed(cur_state, true);
+            while (!path.empty() && !path.back().first->payload && path.back().first->d_success.empty()) {
+                cur_state = path.back().first;
+                const CharType label = path.back().second;
+                path.pop_back();
+                const state_ptr_type parent = path.empty() ? d_root.get() : path.back().first;
+                if (!d_incremental) {
+                    d_constructed_failure_states = false; // the rebuild sets every link before a traversal follows one.
+                } else {
+                    if (d_constructed_failure_states) { // nothing outputs through it, the states failing to it fail one step further.
+                        while (state_ptr_type child = links(cur_state).failure_children) {
+                            unlink_failure(child);
+                            link_failure(child, cur_state->d_failure);
+                        }
+                        unlink_failure(cur_state);
+                    }
+                    d_links.erase(cur_state);
+                }
+                auto it = std::lower_bound(parent->d_success.begin(), parent->d_success.end(), label,
+                                           [](const typename state_type::success_entry &e, const CharType &c) {
+                                               return e.first < c;
+                                           });
+                parent->d_success.erase(it); // frees the state.
+            }
+            return true;
+        }
+
+        bool erase(const string_type &s) { // use the trie as a ordinary container...
+            return erase(s.begin(), s.end());
+        }
+
+        // from now on map and erase repair the failure and output links they affect, instead of leaving all of them to
+        // be rebuilt by the next scan. an update costs time in proportion to the states whose links change; one that
+        // would have to look at more than a small fraction of the trie leaves the links to the next scan after all, and
+        // so do the updates after it. build the dictionary first, it is faster in one go. the parents and the failure
+        // tree are kept in a side table from now on.
+        void enable_incremental_updates() {
+            std::lock_guard<std::mutex> lock(d_construct_mutex);
+            d_incremental = true;
+            d_links.clear();
+            std::vector<state_ptr_type> pending(1, d_root.get());
+            while (!pending.empty()) {
+                const state_ptr_type cur_state = pending.back();
+                pending.pop_back();
+                for (const auto &char_child : cur_state->d_success) {
+                    d_links[char_child.second.get()] = incremental_links{cur_state, char_child.first, nullptr, nullptr, nullptr};
+                    pending.push_back(char_child.second.get());
+                }
+            }
+            build_failure_states(); // also builds the failure tree.
+        }
+
+        bool incremental_updates() const {
+            return d_incremental;
+        }
+
+        typedef begin_end_value<value_type> BeginEndValue;
+
+        // the scanning functions are const and safe to call from several threads at once, as long as no thread modifies the
+        // trie meanwhile (see published_automaton to swap in a new pattern set).
+        std::vector<BeginEndValue> collect_matches(const string_type &v) const {
+            return collect_matches(v.begin(), v.end());
+        }
+
+        // positions are offsets counted while scanning, so this works with input iterators such as istreambuf_iterator.
+        template<typename iteratortype>
+        std::vector<BeginEndValue> collect_matches(const iteratortype &begin, const iteratortype &end) const {
+            std::vector<BeginEndValue> hits;
+            collect_matches(begin, end, hits);
+            return hits;
+        }
+
+        template<typename iteratortype, typename callbackfct>
+        void iterate_matches(
+                const iteratortype &begin,
+                const iteratortype &end,
+                const callbackfct &fct) const { //std::function<bool(const value_type &, const iteratortype&, const iteratortype&)>
+            check_construct_failure_states();
+            state_ptr_type cur_state = d_root.get();
+            match_begin_finder<iteratortype> finder(d_max_depth);
+            for (auto i = begin; i != end;) {
+                finder.push(i);
+                cur_state = get_state(cur_state, *i);
+                ++i;
+                const iteratortype &posend = i;
+                bool go_on = iterate_outputs(cur_state, [&fct, &finder, &posend](const value_type &v, std::size_t depth) {
+                    return fct(v, finder.begin(posend, depth), posend);
+                });
+                if (!go_on) {
+                    return;
+                }
+            }
+        }
+
+        template<typename callbackfct>
+        void iterate_matches(const string_type &s,
+                             const callbackfct &fct) const {
+            iterate_matches(s.begin(), s.end(), fct);
+        }
+
+        template<typename callbackfct>
+        bool iterate_outputs(state_ptr_type cur_state, const callbackfct &fct) const { // fct(const value_type &, std::size_t depth)
+            for (cur_state = cur_state->first_output(); cur_state; cur_state = cur_state->d_output) {
+                AHO_CORASICK_COUNT(matches, 1);
+                if (!fct(*cur_state->payload, cur_state->depth)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // resumable scan: continues from cur_state with *begin at absolute offset pos, reports fct(value, begin offset,
+        // end offset) and leaves cur_state/pos behind the last consumed symbol. returns false when fct asked to stop.
+        template<typename iteratortype, typename callbackfct>
+        bool scan(state_ptr_type &cur_state, std::size_t &pos, const iteratortype &begin, const iteratortype &end, const callbackfct &fct) const {
+            check_construct_failure_states();
+            for (auto i = begin; i != end; ++i) {
+                cur_state = get_state(cur_state, *i);
+                const std::size_t e = ++pos;
+                bool go_on = iterate_outputs(cur_state, [&fct, e](const value_type &v, std::size_t depth) {
+                    return fct(v, e - depth, e);
+                });
+                if (!go_on) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // the matches of kind, see match_kind.
+        template<typename iteratortype>
+        std::vector<BeginEndValue> collect_matches(const iteratortype &begin, const iteratortype &end, match_kind kind) const {
+            std::vector<BeginEndValue> hits;
+            collect_matches(begin, end, hits, kind);
+            return hits;
+        }
+
+        std::vector<BeginEndValue> collect_matches(const string_type &v, match_kind kind) const {
+            return collect_matches(v.begin(), v.end(), kind);
+        }
+
+        // appends the matches to sink instead of returning a new vector: a sink that is cleared and reused between scans
+        // keeps its capacity, so scanning stops allocating once it has grown.
+        template<typename iteratortype>
+        void collect_matches(const iteratortype &begin,
+                             const iteratortype &end,
+                             std::vector<BeginEndValue> &sink,
+                             match_kind kind = match_kind::overlapping) const {
+            check_construct_failure_states();
+            scan_matches(*this, kind, begin, end, [&sink](const value_type &v, std::size_t b, std::size_t e) {
+                sink.push_back(BeginEndValue{b, e, v});
+                return true;
+            });
+        }
+
+        void collect_matches(const string_type &v, std::vector<BeginEndValue> &sink, match_kind kind = match_kind::overlapping) const {
+            collect_matches(v.begin(), v.end(), sink, kind);
+        }
+
+        std::size_t state_depth(state_ptr_type cur_state) const {
+            return cur_state->depth;
+        }
+
+        // the longest match ending in cur_state, priority is its pattern id.
+        bool longest_output(state_ptr_type cur_state, const value_type *&v, std::size_t &depth, std::size_t &priority) const {
+            state_ptr_type o = cur_state->first_output();
+            if (!o) {
+                return false;
+            }
+            v = o->payload.get();
+            depth = o->depth;
+            priority = o->pattern_id;
+            return true;
+        }
+
+        template<typename iteratortype>
+        std::size_t skip_to_candidate(iteratortype &, const iteratortype &) const { // no prefilter here.
+            return 0;
+        }
+
+        bool has_output(state_ptr_type cur_state) const {
+            return cur_state->first_output() != nullptr;
+        }
+
+        state_ptr_type null_state() const {
+            return nullptr;
+        }
+
+        state_ptr_type state_failure(state_ptr_type cur_state) const {
+            return cur_state->d_failure;
+        }
+
+        const value_type &state_payload(state_ptr_type cur_state) const {
+            return *cur_state->payload;
+        }
+
+        const leftmost_links<state_ptr_type> &leftmost(state_ptr_type cur_state) const {
+            return d_leftmost[cur_state->leftmost_index];
+        }
+
+        template<typename callbackfct>
+        void iterate_pattern_ids(state_ptr_type cur_state, const callbackfct &fct) const { // fct(std::size_t pattern id)
+            for (cur_state = cur_state->first_output(); cur_state; cur_state = cur_state->d_output) {
+                AHO_CORASICK_COUNT(matches, 1);
+                fct(cur_state->pattern_id);
+            }
+        }
+
+        std::size_t pattern_id_count() const { // pattern ids are handed out in mapping order, erased ones are not reused.
+            return d_next_pattern_id;
+        }
+
+        template<typename iteratortype>
+        bool contains_any(const iteratortype &begin, const iteratortype &end) const {
+            return aho_corasick::contains_any(*this, begin, end);
+        }
+
+        bool contains_any(const string_type &s) const {
+            return contains_any(s.begin(), s.end());
+        }
+
+        template<typename iteratortype>
+        const value_type *find_first(const iteratortype &begin,
+                                     const iteratortype &end,
+                                     std::size_t *match_begin = nullptr,
+                                     std::size_t *match_end = nullptr) const {
+            return aho_corasick::find_first(*this, begin, end, match_begin, match_end);
+        }
+
+        const value_type *find_first(const string_type &s, std::size_t *match_begin = nullptr, std::size_t *match_end = nullptr) const {
+            return find_first(s.begin(), s.end(), match_begin, match_end);
+        }
+
+        template<typename iteratortype>
+        std::size_t count_matches(const iteratortype &begin, const iteratortype &end) const {
+            return aho_corasick::count_matches(*this, begin, end);
+        }
+
+        std::size_t count_matches(const string_type &s) const {
+            return count_matches(s.begin(), s.end());
+        }
+
+        template<typename iteratortype>
+        std::size_t count_pattern_matches(const iteratortype &begin, const iteratortype &end, std::vector<std::size_t> &histogram) const {
+            return aho_corasick::count_pattern_matches(*this, begin, end, histogram);
+        }
+
+        std::size_t count_pattern_matches(const string_type &s, std::vector<std::size_t> &histogram) const {
+            return count_pattern_matches(s.begin(), s.end(), histogram);
+        }
+
+        // one walk over all states (building the failure links first if needed), cheap enough to log now and then.
+        trie_statistics statistics() const {
+            check_construct_failure_states();
+            trie_statistics result;
+            std::vector<state_ptr_type> pending(1, d_root.get());
+            while (!pending.empty()) {
+                const state_ptr_type cur_state = pending.back();
+                pending.pop_back();
+                ++result.states;
+                result.transitions += cur_state->d_success.size();
+                result.transition_bytes += cur_state->d_success.capacity() * sizeof(typename state_type::success_entry);
+                if (cur_state->payload) {
+                    ++result.patterns;
+                }
+                std::size_t chain = 0;
+                for (state_ptr_type s = cur_state; s != d_root.get(); s = s->d_failure) {
+                    ++chain;
+                }
+                count_in(result.fan_out, cur_state->d_success.size());
+                count_in(result.depth, cur_state->depth);
+                count_in(result.failure_chain, chain);
+                for (const auto &char_child : cur_state->d_success) {
+                    pending.push_back(char_child.second.get());
+                }
+            }
+            result.state_bytes = result.states * sizeof(state_type);
+            result.payload_bytes = result.patterns * sizeof(value_type);
+            result.storage_bytes = d_storage.memory_usage();
+            result.link_bytes = d_links.size() * (sizeof(typename decltype(d_links)::value_type) + 2 * sizeof(void *)) // node, bucket.
+                                + d_root_failure_children.size() * (sizeof(typename decltype(d_root_failure_children)::value_type) + 4 * sizeof(void *))
+                                + d_leftmost.capacity() * sizeof(typename decltype(d_leftmost)::value_type);
+            return result;
+        }
+
+        stream_matcher<basic_trie> stream(match_kind kind = match_kind::overlapping) const {
+            check_construct_failure_states();
+            return stream_matcher<basic_trie>(*this, kind);
+        }
+
+        // same result as collect_matches, computed on threads (0: one per core) for random access input.
+        template<typename iteratortype>
+        std::vector<BeginEndValue> parallel_collect_matches(const iteratortype &begin, const iteratortype &end, std::size_t threads = 0) const {
+            check_construct_failure_states();
+            return aho_corasick::parallel_collect_matches(*this, begin, end, threads);
+        }
+
+        std::vector<BeginEndValue> parallel_collect_matches(const string_type &v, std::size_t threads = 0) const {
+            return parallel_collect_matches(v.begin(), v.end(), threads);
+        }
+
+        state_ptr_type get_state(state_ptr_type cur_state, CharType c) const {
+            AHO_CORASICK_COUNT(symbols, 1);
+            AHO_CORASICK_COUNT(states_visited, 1);
+            const CharType symbol = d_symbols(c);
+            state_ptr_type result = cur_state->next_state_no_failure(symbol, d_root.get());
+            while (result == nullptr) {
+                cur_state = cur_state->d_failure;
+                AHO_CORASICK_COUNT(failure_hops, 1);
+                AHO_CORASICK_COUNT(states_visited, 1);
+                result = cur_state->next_state_no_failure(symbol, d_root.get());
+            }
+            return result;
+        }
+
+        // freeze the current patterns into a flat, immutable automaton; later changes to this trie are not reflected in it.
+        template<typename transitions = sorted_transitions<CharType> >
+        compiled_trie<string_type, value_type, transitions, symbol_map> compile() const { // the storage policy is not part of the result.
+            return compiled_trie<string_type, value_type, transitions, symbol_map>(*this);
+        }
+
+#ifndef AHO_CORASICK_NOEXTRAS
+
+        // the same patterns and payloads as a byte automaton over their utf-8 encoding (see to_utf8), which scans utf-8
+        // input as is, with the dense table and the prefilter. pattern ids keep their order. scan_utf8 reports
+        // character offsets, the scans of the automaton itself byte offsets.
+        template<typename transitions = dense_transitions<char> >
+        compiled_trie<std::string, value_type, transitions> compile_utf8() const {
+            static_assert(std::is_same<symbol_map, identity_symbols<CharType> >::value, "compile_utf8 does not carry a symbol map over");
+            std::vector<std::pair<std::size_t, std::pair<std::string, state_ptr_type> > > patterns; // pattern id first.
+            std::vector<std::pair<state_ptr_type, CharType> > pending(1, std::make_pair(d_root.get(), CharType()));
+            string_type path; // depth first: it holds the labels up to the current state.
+            while (!pending.empty()) {
+                const state_ptr_type cur_state = pending.back().first;
+                path.resize(cur_state->depth);
+                if (cur_state->depth) {
+                    path[cur_state->depth - 1] = pending.back().second;
+                }
+                pending.pop_back();
+                if (cur_state->payload) {
+                    patterns.push_back(std::make_pair(cur_state->pattern_id, std::make_pair(to_utf8(path), cur_state)));
+                }
+                for (const auto &char_child : cur_state->d_success) {
+                    pending.push_back(std::make_pair(char_child.second.get(), char_child.first));
+                }
+            }
+            std::sort(patterns.begin(), patterns.end(),
+                      [](const std::pair<std::size_t, std::pair<std::string, state_ptr_type> > &a,
+                         const std::pair<std::size_t, std::pair<std::string, state_ptr_type> > &b) {
+                          return a.first < b.first;
+                      });
+            basic_trie<std::string, value_type> bytes;
+            for (const auto &pattern : patterns) {
+                bytes.map(pattern.second.first, *pattern.second.second->payload);
+            }
+            return bytes.template compile<transitions>();
+        }
+
+#endif
+
+        void check_construct_failure_states() const {
+            if (!d_constructed_failure_states.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(d_construct_mutex);
+                if (!d_constructed_failure_states.load(std::memory_order_relaxed)) {
+                    build_failure_states();
+                }
+            }
+        }
+
+        // the links of the leftmost kinds, only their scans build them (after the failure links).
+        void check_construct_leftmost_links() const {
+            if (!d_built_leftmost_links.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(d_construct_mutex);
+                if (!d_built_leftmost_links.load(std::memory_order_relaxed)) {
+                    build_leftmost_links();
+                }
+            }
+        }
+
+        // threads: 0 is one per core, more than one builds level by level in parallel.
+        void construct_failure_states(std::size_t threads = 1) {
+            std::lock_guard<std::mutex> lock(d_construct_mutex);
+            if (threads == 1) {
+                build_failure_states();
+            } else {
+                build_failure_states_parallel(threads);
+            }
+        }
+
+        // maps the (pattern, value) pairs (first, second) of the random access range [first, last), much quicker than a
+        // map per pair when the patterns are sorted: each pattern continues from the states of the previous one and
+        // appends its new edges. unsorted input works too, only slower. pattern ids follow the order of the range.
+        // when the storage is thread safe, incremental updates are off and the range is sorted on the first symbol,
+        // the patterns are split over threads (0: one per core) on their first symbol, so each owns its subtrees.
+        template<typename iteratortype>
+        void map_sorted(const iteratortype &first, const iteratortype &last, std::size_t threads = 0) {
+            typedef typename string_type::traits_type traits_type;
+            const std::size_t count = static_cast<std::size_t>(last - first);
+            const std::size_t first_id = d_next_pattern_id;
+            if (d_incremental) {
+                for (auto i = first; i != last; ++i) {
+                    map(i->first, i->second);
+                }
+                return;
+            }
+            if (threads == 0) {
+                threads = std::max<unsigned>(1, std::thread::hardware_concurrency());
+            }
+            for (std::size_t i = 1; i < count && threads > 1; ++i) {
+                const string_type &a = first[i - 1].first;
+                const string_type &b = first[i].first;
+                if (!a.empty() && (b.empty() || traits_type::lt(d_symbols(b[0]), d_symbols(a[0])))) {
+                    threads = 1;
+                }
+            }
+            if (!storage_type::thread_safe) {
+                threads = 1;
+            }
+            std::vector<std::size_t> cuts(1, 0); // on changes of the first symbol.
+            for (std::size_t t = 1; t < threads; ++t) {
+                std::size_t cut = std::max(cuts.back(), count * t / threads);
+                while (cut > 0 && cut < count && !first[cut - 1].first.empty() && same_symbol(first[cut - 1].first[0], first[cut].first[0])) {
+                    ++cut;
+                }
+                cuts.push_back(cut);
+            }
+            cuts.push_back(count);
+            for (std::size_t i = 0; threads > 1 && i < count; ++i) { // the root edges are shared, create them up front.
+                if (!first[i].first.empty()) {
+                    add_state(d_root.get(), first[i].first[0]);
+                }
+            }
+            std::vector<std::size_t> max_depths(threads, 0);
+            parallel_for_ranges(threads, threads, [&](std::size_t t, std::size_t, std::size_t) {
+                std::vector<state_ptr_type> path(1, d_root.get()); // states of the previous pattern.
+                const string_type *previous = nullptr;
+                for (std::size_t i = cuts[t]; i < cuts[t + 1]; ++i) {
+                    const string_type &pattern = first[i].first;
+                    std::size_t common = 0;
+                    if (previous) {
+                        const std::size_t n = std::min(previous->size(), pattern.size());
+                        common = static_cast<std::size_t>(std::mismatch(pattern.begin(), pattern.begin() + n, previous->begin(),
+                                                                        [this](const CharType &a, const CharType &b) {
+                                                                            return same_symbol(a, b);
+                                                                        }).first - pattern.begin());
+                    }
+                    path.resize(common + 1);
+                    state_ptr_type cur_state = path.back();
+                    for (std::size_t k = common; k < pattern.size(); ++k) {
+                        cur_state = append_child(cur_state, d_symbols(pattern[k]));
+                        path.push_back(cur_state);
+                    }
+                    const bool had_payload = cur_state->payload.get() != nullptr;
+                    cur_state->set_value(first[i].second, d_storage);
+                    if (!had_payload) {
+                        cur_state->pattern_id = first_id + i;
+                    }
+                    max_depths[t] = std::max(max_depths[t], pattern.size());
+                    previous = &pattern;
+                }
+            });
+            for (auto depth : max_depths) {
+                d_max_depth = std::max(d_max_depth, depth);
+            }
+            d_next_pattern_id = first_id + count;
+            d_constructed_failure_states = false;
+            d_built_leftmost_links = false;
+        }
+
+        template<typename pairtype>
+        void map_sorted(const std::vector<pairtype> &patterns, std::size_t threads = 0) {
+            map_sorted(patterns.begin(), patterns.end(), threads);
+        }
+
+    private:
+        bool same_symbol(const CharType &a, const CharType &b) const {
+            return d_symbols(a) == d_symbols(b);
+        }
+
+        static void count_in(std::vector<std::size_t> &histogram, std::size_t value) {
+            if (histogram.size() <= value) {
+                histogram.resize(value + 1, 0);
+            }
+            ++histogram[value];
+        }
+
+        typename state_type::unique_ptr create_child(state_ptr_type parent) {
+            d_built_leftmost_links = false;
+            return d_storage.template create_node<state_type>(parent->depth + 1, d_storage.template get_allocator<typename state_type::success_entry>());
+        }
+
+        // the child of map_sorted: sorted input only ever adds edges behind the existing ones.
+        state_ptr_type append_child(state_ptr_type parent, const CharType &character) {
+            if (parent->d_success.empty() || parent->d_success.back().first < character) {
+                parent->d_success.emplace_back(character, create_child(parent));
+                return parent->d_success.back().second.get();
+            }
+            auto &p = getOrCreateOrderedUniqueKV(parent->d_success, character);
+            if (!p.get()) {
+                p = create_child(parent);
+            }
+            return p.get();
+        }
+
+        // level-synchronous: the failure links of depth d + 1 only read states of depth d or less, so the states of a
+        // level are split over the threads. small levels stay on the calling thread.
+        void build_failure_states_parallel(std::size_t threads) const {
+            const std::size_t min_states_per_thread = 1 << 12;
+            if (threads == 0) {
+                threads = std::max<unsigned>(1, std::thread::hardware_concurrency());
+            }
+            state_ptr_type root = d_root.get();
+            reset_failure_tree();
+            std::vector<state_ptr_type> level(1, root);
+            std::vector<std::vector<state_ptr_type> > children;
+            while (!level.empty()) {
+                const std::size_t level_threads = std::min(threads, level.size() / min_states_per_thread + 1);
+                children.resize(level_threads);
+                parallel_for_ranges(level.size(), level_threads, [&](std::size_t begin, std::size_t end, std::size_t range) {
+                    std::vector<state_ptr_type> &next = children[range];
+                    next.clear();
+                    for (std::size_t i = begin; i < end; ++i) {
+                        state_ptr_type cur_state = level[i];
+                        for (const auto &char_child : cur_state->d_success) {
+                            state_ptr_type target_state = char_child.second.get();
+                            if (cur_state == root) {
+                                target_state->d_failure = root;
+                            } else {
+                                state_ptr_type trace_failure_state = cur_state->d_failure;
+                                while (trace_failure_state->next_state_no_failure(char_child.first, root) == nullptr) {
+                                    trace_failure_state = trace_failure_state->d_failure;
+                                }
+                                target_state->d_failure = trace_failure_state->next_state_no_failure(char_child.first, root);
+                            }
+                            target_state->d_output = target_state->d_failure->first_output();
+                            next.push_back(target_state);
+                        }
+                    }
+                });
+                level.clear();
+                for (std::size_t r = 0; r < level_threads; ++r) {
+                    level.insert(level.end(), children[r].begin(), children[r].end());
+                }
+                if (d_incremental) { // the failure tree lists are shared, link serially.
+                    for (state_ptr_type s : level) {
+                        link_failure(s, s->d_failure);
+                    }
+                }
+            }
+            d_constructed_failure_states.store(true, std::memory_order_release);
+        }
+
+        void payload_changed(state_ptr_type node, bool had_payload) {
+            if (had_payload != (node->payload.get() != nullptr)) {
+                d_built_leftmost_links = false;
+                if (d_incremental && d_constructed_failure_states && node != d_root.get()) {
+                    propagate_output(node);
+                } else {
+                    d_constructed_failure_states = false; // the output links changed.
+                }
+                if (!had_payload) {
+                    node->pattern_id = d_next_pattern_id++;
+                }
+            }
+        }
+
+        incremental_links &links(state_ptr_type s) const {
+            return d_links.find(s)->second;
+        }
+
+        state_ptr_type &failure_children(state_ptr_type s, const CharType &label) const {
+            return s == d_root.get() ? d_root_failure_children[label] : links(s).failure_children;
+        }
+
+        // the states an incremental update may visit before it leaves all links to the next rebuild, which visits every
+        // state a few times.
+        std::size_t update_budget() const {
+            return d_links.size() / 32 + 64;
+        }
+
+        void reset_failure_tree() const {
+            d_root_failure_children.clear();
+            for (auto &l : d_links) {
+                l.second.failure_children = nullptr;
+            }
+        }
+
+        void link_failure(state_ptr_type s, state_ptr_type failure) const {
+            s->d_failure = failure;
+            incremental_links &l = links(s);
+            state_ptr_type &head = failure_children(failure, l.label);
+            l.failure_prev = nullptr;
+            l.failure_next = head;
+            if (head) {
+                links(head).failure_prev = s;
+            }
+            head = s;
+        }
+
+        void unlink_failure(state_ptr_type s) const {
+            incremental_links &l = links(s);
+            if (l.failure_prev) {
+                links(l.failure_prev).failure_next = l.failure_next;
+            } else {
+                failure_children(s->d_failure, l.label) = l.failure_next;
+            }
+            if (l.failure_next) {
+                links(l.failure_next).failure_prev = l.failure_prev;
+            }
+        }
+
+        // failure and output links of a new (payload-less) state n, the child of parent. the states that now fail to n
+        // are the label children of the states in the failure subtree of parent (those ending with its string), up to
+        // the states with a label child of their own: below those, the longer suffix wins. for a child of the root these
+        // are exactly the states with that label that failed to the root. an update that gets too long leaves everything
+        // to the next rebuild instead. the outputs of the states that move do not change.
+        void link_new_state(state_ptr_type n, state_ptr_type parent, const CharType &label) {
+            d_links[n] = incremental_links{parent, label, nullptr, nullptr, nullptr};
+            if (!d_constructed_failure_states) { // a rebuild is due anyway.
+                return;
+            }
+            state_ptr_type failure = d_root.get();
+            if (parent != d_root.get()) {
+                state_ptr_type trace_failure_state = parent->d_failure;
+                while (trace_failure_state->next_state_no_failure(label, d_root.get()) == nullptr) {
+                    trace_failure_state = trace_failure_state->d_failure;
+                }
+                failure = trace_failure_state->next_state_no_failure(label, d_root.get());
+            }
+            n->d_failure = failure;
+            n->d_output = failure->first_output();
+            std::size_t budget = update_budget();
+            if (parent == d_root.get()) {
+                while (state_ptr_type u = d_root_failure_children[label]) {
+                    if (budget-- == 0) {
+                        d_constructed_failure_states = false;
+                        return;
+                    }
+                    unlink_failure(u);
+                    link_failure(u, n);
+                }
+            } else {
+                std::vector<state_ptr_type> pending;
+                for (state_ptr_type q = links(parent).failure_children; q; q = links(q).failure_next) {
+                    pending.push_back(q);
+                }
+                while (!pending.empty()) {
+                    if (budget-- == 0) {
+                        d_constructed_failure_states = false;
+                        return;
+                    }
+                    const state_ptr_type q = pending.back();
+                    pending.pop_back();
+                    if (state_ptr_type u = q->lookupchild(label)) {
+                        unlink_failure(u);
+                        link_failure(u, n);
+                        continue;
+                    }
+                    for (state_ptr_type r = links(q).failure_children; r; r = links(r).failure_next) {
+                        pending.push_back(r);
+                    }
+                }
+            }
+            link_failure(n, failure);
+        }
+
+        // node (not the root) gained or lost its payload: fixes the output links in its failure subtree, down to the
+        // states with a payload of their own. like link_new_state, it leaves a subtree that is too large to the next
+        // rebuild.
+        void propagate_output(state_ptr_type node) {
+            std::size_t budget = update_budget();
+            std::vector<state_ptr_type> pending(1, node);
+            while (!pending.empty()) {
+                const state_ptr_type cur_state = pending.back();
+                pending.pop_back();
+                const state_ptr_type output = cur_state->first_output();
+                for (state_ptr_type child = links(cur_state).failure_children; child; child = links(child).failure_next) {
+                    if (budget-- == 0) {
+                        d_constructed_failure_states = false;
+                        return;
+                    }
+                    if (child->d_output != output) {
+                        child->d_output = output;
+                        if (!child->payload) {
+                            pending.push_back(child);
+                        }
+                    }
+                }
+            }
+        }
+
+        void build_failure_states() const {
+            std::queue<state_ptr_type> q; // -> breadth-first iterative deepening...
+            // root has no fail
+            if (d_incremental) {
+                reset_failure_tree();
+            }
+            for (const auto &char_depth_one_state : d_root->d_success) {
+                if (d_incremental) {
+                    link_failure(char_depth_one_state.second.get(), d_root.get());
+                }
+                char_depth_one_state.second->d_failure = d_root.get();
+                char_depth_one_state.second->d_output = d_root->payload ? d_root.get() : nullptr;
+                q.push(char_depth_one_state.second.get());
+            }
+
+            while (!q.empty()) {
+                auto cur_state = q.front();
+                q.pop();
+                for (const auto &char_child : cur_state->d_success) {
+                    state_ptr_type target_state = char_child.second.get(); //cur_state->next_state(transition);
+                    q.push(target_state);
+
+                    state_ptr_type trace_failure_state = cur_state->d_failure;
+                    while (trace_failure_state->next_state_no_failure(char_child.first, d_root.get()) == nullptr) {
+                        trace_failure_state = trace_failure_state->d_failure;
+                    }
+                    target_state->d_failure = trace_failure_state->next_state_no_failure(char_child.first, d_root.get());
+                    if (d_incremental) {
+                        link_failure(target_state, target_state->d_failure);
+                    }
+                    target_state->d_output = target_state->d_failure->first_output(); // parents are done before children.
+                }
+
+            }
+            d_constructed_failure_states.store(true, std::memory_order_release);
+        }
+
+        void build_leftmost_links() const {
+            const state_ptr_type root = d_root.get();
+            auto links_of = [this](state_ptr_type s) -> const leftmost_links<state_ptr_type> & {
+                return d_leftmost[s->leftmost_index];
+            };
+            auto depth_of = [](state_ptr_type s) {
+                return s->depth;
+            };
+            auto priority_of = [](state_ptr_type s) {
+                return s->pattern_id;
+            };
+            d_leftmost.assign(1, leftmost_links<state_ptr_type>{nullptr, nullptr, nullptr, nullptr, nullptr});
+            root->leftmost_index = 0;
+            std::vector<state_ptr_type> order(1, root); // breadth-first, doubles as the queue.
+            for (std::size_t i = 0; i < order.size(); ++i) {
+                for (const auto &char_child : order[i]->d_success) {
+                    const state_ptr_type child = char_child.second.get();
+                    const leftmost_links<state_ptr_type> links = derive_leftmost_links(child, order[i], child->d_failure, child->payload.get() != nullptr,
+                                                                                     state_ptr_type(), links_of, depth_of, priority_of);
+                    child->leftmost_index = static_cast<std::uint32_t>(d_leftmost.size());
+                    d_leftmost.push_back(links);
+                    order.push_back(child);
+                }
+            }
+            d_built_leftmost_links.store(true, std::memory_order_release);
+        }
+
+    public:
+
+#ifndef AHO_CORASICK_NOEXTRAS
+
+        std::string toDot() const {
+            check_construct_failure_states(); // it follows the failure and output links.
+            std::ostringstream oss;
+            oss << "digraph 123 { graph [rankdir=LR]; node [shape=box] " << std::endl;
+            std::queue<state_ptr_type> q;
+            q.push(d_root.get());
+            while (!q.empty()) {
+                auto cur_state = q.front();
+                q.pop();
+
+
+                oss << (std::size_t) cur_state << " [label=\"";
+                cur_state->iterate_values((std::size_t) 0, [&oss](const value_type &v, const std::size_t &, const std::size_t &) {
+                    oss << v << "\\" << "r";
+                    return true;
+                });
+                oss << "\"];" << std::endl;
+                for (const auto &char_child : cur_state->d_success) {
+                    state_ptr_type target_state = char_child.second.get();// cur_state->next(transition,d_root);
+                    q.push(target_state);
+                    oss << (std::size_t) cur_state << " -> " << (std::size_t) target_state << " [label=\"" << char_child.first << "\",color=green]" << std::endl;
+                }
+                if (cur_state->d_failure && cur_state->d_failure != d_root.get()) {
+                    oss << (std::size_t) cur_state << " -> " << (std::size_t) cur_state->d_failure << " [color=red,constraint=false];" << std::endl;
+                }
+            }
+
+            oss << "}" << std::endl;
+            return oss.str();
+        }
+
+#endif
+
+    };
+
+#ifdef AHO_CORASICK_MMAP
+
+    // read-only memory mapping of a file, one window at a time.
+    class mapped_file {
+        int d_fd;
+        std::size_t d_file_size;
+        const char *d_data;
+        std::size_t d_length;
+
+    public:
+        explicit mapped_file(const std::string &path) :
+                d_fd(::open(path.c_str(), O_RDONLY)),
+                d_file_size(0),
+                d_data(nullptr),
+                d_length(0) {
+            if (d_fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "aho_corasick::mapped_file: cannot open " + path);
+            }
+            struct stat st;
+            if (::fstat(d_fd, &st) != 0) {
+                const int error = errno;
+                ::close(d_fd);
+                throw std::system_error(error, std::generic_category(), "aho_corasick::mapped_file: cannot stat " + path);
+            }
+            d_file_size = static_cast<std::size_t>(st.st_size);
+        }
+
+        mapped_file(const mapped_file &) = delete;
+
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        ~mapped_file() {
+            unmap();
+            ::close(d_fd);
+        }
+
+        static std::size_t page_size() {
+            return static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        }
+
+        std::size_t file_size() const {
+            return d_file_size;
+        }
+
+        // maps [offset, offset + length) (clipped to the file) in place of the previous window; offset must be a
+        // multiple of page_size(). the advice is passed on to madvise, sequential scans let the kernel read ahead.
+        const char *map(std::size_t offset, std::size_t length, int advice = MADV_SEQUENTIAL) {
+            unmap();
+            length = std::min(length, d_file_size - std::min(offset, d_file_size));
+            if (length == 0) {
+                return nullptr;
+            }
+            void *p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, d_fd, static_cast<off_t>(offset));
+            if (p == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "aho_corasick::mapped_file: mmap failed");
+            }
+            ::madvise(p, length, advice);
+            d_data = static_cast<const char *>(p);
+            d_length = length;
+            return d_data;
+        }
+
+        void unmap() {
+            if (d_data) {
+                ::munmap(const_cast<char *>(d_data), d_length);
+                d_data = nullptr;
+                d_length = 0;
+            }
+        }
+
+        const char *data() const {
+            return d_data;
+        }
+
+        std::size_t length() const {
+            return d_length;
+        }
+    };
+
+#endif
+
+    // contiguous, read-only array for the compiled automaton. it either owns its elements or looks at memory kept alive
+    // elsewhere (an automaton loaded from a memory mapped file is used in place, without deserialization).
+    template<typename T>
+    class flat_array {
+        std::vector<T> d_owned;
+        const T *d_data;
+        std::size_t d_size;
+
+    public:
+        flat_array() :
+                d_owned(),
+                d_data(nullptr),
+                d_size(0) {
+        }
+
+        flat_array(std::vector<T> &&owned) :
+                d_owned(std::move(owned)),
+                d_data(d_owned.data()),
+                d_size(d_owned.size()) {
+        }
+
+        flat_array(const T *data, std::size_t size) :
+                d_owned(),
+                d_data(data),
+                d_size(size) {
+        }
+
+        flat_array(const flat_array &o) :
+                d_owned(o.d_owned),
+                d_data(o.owns() ? d_owned.data() : o.d_data),
+                d_size(o.d_size) {
+        }
+
+        flat_array(flat_array &&o) :
+                d_owned(),
+                d_data(nullptr),
+                d_size(0) {
+            *this = std::move(o);
+        }
+
+        flat_array &operator=(const flat_array &o) {
+            return *this = flat_array(o);
+        }
+
+        flat_array &operator=(flat_array &&o) {
+            const bool owned = o.owns();
+            d_owned = std::move(o.d_owned);
+            d_data = owned ? d_owned.data() : o.d_data;
+            d_size = o.d_size;
+            o.d_owned.clear();
+            o.d_data = nullptr;
+            o.d_size = 0;
+            return *this;
+        }
+
+        bool owns() const {
+            return d_data == d_owned.data() && !d_owned.empty();
+        }
+
+        // only for arrays being built: the elements may change, the size may not.
+        T *mutable_data() {
+            return d_owned.data();
+        }
+
+        const T &operator[](std::size_t i) const {
+            return d_data[i];
+        }
+
+        const T *data() const {
+            return d_data;
+        }
+
+        const T *begin() const {
+            return d_data;
+        }
+
+        const T *end() const {
+            return d_data + d_size;
+        }
+
+        std::size_t size() const {
+            return d_size;
+        }
+
+        bool empty() const {
+            return d_size == 0;
+        }
+
+        std::size_t memory_usage() const { // heap memory only, mapped memory is shared with the page cache.
+            return d_owned.capacity() * sizeof(T);
+        }
+    };
+
+    // little helpers for the binary automaton format: every array is preceded by its length and starts 64-byte aligned
+    // (relative to the start of the file), so a mapped file can be used in place.
+    class binary_writer {
+        std::ostream &d_os;
+        std::size_t d_offset;
+
+    public:
+        static const std::size_t alignment = 64;
+
+        explicit binary_writer(std::ostream &os) :
+                d_os(os),
+                d_offset(0) {
+        }
+
+        void write_raw(const void *data, std::size_t size) {
+            d_os.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+            d_offset += size;
+        }
+
+        template<typename T>
+        void write(const T &v) {
+            static_assert(std::is_trivially_copyable<T>::value, "binary_writer::write requires a trivially copyable type");
+            write_raw(&v, sizeof(T));
+        }
+
+        void align() {
+            static const char zeros[alignment] = {};
+            write_raw(zeros, (alignment - d_offset % alignment) % alignment);
+        }
+
+        template<typename T>
+        void write_array(const T *data, std::size_t count) {
+            static_assert(std::is_trivially_copyable<T>::value, "binary_writer::write_array requires a trivially copyable type");
+            write<std::uint64_t>(count);
+            align();
+            write_raw(data, count * sizeof(T));
+        }
+
+        template<typename T>
+        void write_array(const flat_array<T> &a) {
+            write_array(a.data(), a.size());
+        }
+    };
+
+    class binary_reader {
+        const char *d_begin;
+        const char *d_pos;
+        const char *d_end;
+
+    public:
+        binary_reader(const char *data, std::size_t size) :
+                d_begin(data),
+                d_pos(data),
+                d_end(data + size) {
+        }
+
+        const char *read_bytes(std::size_t size) {
+            if (static_cast<std::size_t>(d_end - d_pos) < size) {
+                throw std::runtime_error("aho_corasick::binary_reader: truncated automaton file");
+            }
+            const char *result = d_pos;
+            d_pos += size;
+            return result;
+        }
+
+        template<typename T>
+        T read() {
+            T v;
+            std::memcpy(&v, read_bytes(sizeof(T)), sizeof(T));
+            return v;
+        }
+
+        void align() {
+            read_bytes((binary_writer::alignment - (d_pos - d_begin) % binary_writer::alignment) % binary_writer::alignment);
+        }
+
+        // a view on the underlying memory when it is suitably aligned, a copy otherwise.
+        template<typename T>
+        flat_array<T> read_array() {
+            const std::uint64_t count = read<std::uint64_t>();
+            align();
+            if (count > static_cast<std::uint64_t>(d_end - d_pos) / sizeof(T)) {
+                throw std::runtime_error("aho_corasick::binary_reader: truncated automaton file");
+            }
+            const char *data = read_bytes(static_cast<std::size_t>(count) * sizeof(T));
+            if (reinterpret_cast<std::uintptr_t>(data) % alignof(T) != 0) {
+                std::vector<T> copy(static_cast<std::size_t>(count));
+                std::memcpy(copy.data(), data, copy.size() * sizeof(T));
+                return flat_array<T>(std::move(copy));
+            }
+            return flat_array<T>(reinterpret_cast<const T *>(data), static_cast<std::size_t>(count));
+        }
+    };
+
+    // how payloads are stored in a saved automaton. trivially copyable payloads are stored as an array and used in place
+    // after loading (mappable), others need write(binary_writer &, const value_type &) and read(binary_reader &).
+    template<typename value_type, typename Enable = void>
+    struct payload_serializer {
+        static_assert(std::is_trivially_copyable<value_type>::value,
+                      "payloads that are not trivially copyable need a payload_serializer specialization");
+        static const bool mappable = true;
+    };
+
+#ifndef AHO_CORASICK_NOEXTRAS
+
+    template<typename C, typename traits, typename allocator>
+    struct payload_serializer<std::basic_string<C, traits, allocator> > {
+        static const bool mappable = false;
+
+        static void write(binary_writer &w, const std::basic_string<C, traits, allocator> &v) {
+            w.write<std::uint64_t>(v.size());
+            w.write_raw(v.data(), v.size() * sizeof(C));
+        }
+
+        static std::basic_string<C, traits, allocator> read(binary_reader &r) {
+            const std::size_t size = static_cast<std::size_t>(r.read<std::uint64_t>());
+            const char *data = r.read_bytes(size * sizeof(C));
+            std::basic_string<C, traits, allocator> v(size, C());
+            if (size) {
+                std::memcpy(&v[0], data, size * sizeof(C));
+            }
+            return v;
+        }
+    };
+
+#endif
+
+    // symbol maps for basic_trie and compiled_trie: every symbol of a pattern (when it is mapped) and of the input (in
+    // the transition function) is replaced by its representative, so equivalent symbols share their transitions and
+    // the input needs no transformed copy. a compiled automaton saves the map along with the transitions.
+
+    // every symbol stands for itself.
+    template<typename CharType>
+    struct identity_symbols {
+        static const char *name() {
+            return "identity";
+        }
+
+        const CharType &operator()(const CharType &c) const {
+            return c;
+        }
+
+        void save(binary_writer &) const {
+        }
+
+        void load(binary_reader &) {
+        }
+    };
+
+    // ascii letters match regardless of case: they are folded to lower case. other symbols (utf-8 bytes included) stay.
+    template<typename CharType>
+    struct ascii_case_folding {
+        static_assert(std::is_integral<CharType>::value, "ascii_case_folding requires an integral character type");
+
+        static const char *name() {
+            return "ascii_case";
+        }
+
+        CharType operator()(const CharType &c) const {
+            return c >= 'A' && c <= 'Z' ? static_cast<CharType>(c - 'A' + 'a') : c;
+        }
+
+        void save(binary_writer &) const {
+        }
+
+        void load(binary_reader &) {
+        }
+    };
+
+    // an arbitrary table from byte values to their representative, e.g. every digit to '0'. starts as the identity,
+    // symbols above 255 always stand for themselves.
+    template<typename CharType>
+    class byte_class_map {
+        static_assert(std::is_integral<CharType>::value, "byte_class_map requires an integral character type");
+
+        typedef typename std::make_unsigned<CharType>::type unsigned_char_type;
+
+        unsigned char d_table[256];
+
+    public:
+        static const char *name() {
+            return "byte_class";
+        }
+
+        byte_class_map() {
+            for (std::size_t b = 0; b < 256; ++b) {
+                d_table[b] = static_cast<unsigned char>(b);
+            }
+        }
+
+        explicit byte_class_map(const unsigned char (&table)[256]) {
+            std::memcpy(d_table, table, sizeof(d_table));
+        }
+
+        // bytes first..last (inclusive) stand for representative from now on.
+        byte_class_map &map(unsigned char first, unsigned char last, unsigned char representative) {
+            for (std::size_t b = first; b <= last; ++b) {
+                d_table[b] = representative;
+            }
+            return *this;
+        }
+
+        byte_class_map &map(unsigned char byte, unsigned char representative) {
+            return map(byte, byte, representative);
+        }
+
+        CharType operator()(const CharType &c) const {
+            const std::size_t b = static_cast<unsigned_char_type>(c);
+            return b < 256 ? static_cast<CharType>(d_table[b]) : c;
+        }
+
+        void save(binary_writer &w) const {
+            w.write_raw(d_table, sizeof(d_table));
+        }
+
+        void load(binary_reader &r) {
+            std::memcpy(d_table, r.read_bytes(sizeof(d_table)), sizeof(d_table));
+        }
+    };
+
+    // transition policies for compiled_trie, they decide how the goto function of the compiled automaton is stored.
+    // a policy is complete when next() already resolves the failure transitions (and applies the symbol map itself),
+    // otherwise lookupchild() only follows trie edges, for mapped symbols, and the automaton walks the failure links on a
+    // mismatch.
+
+    // binary search over the sorted labels of the children, costs nothing on top of the compiled arrays.
+    template<typename CharType>
+    class sorted_transitions {
+    public:
+        static const bool complete = false;
+
+        static const char *name() {
+            return "sorted";
+        }
+
+        template<typename automaton_type>
+        void build(const automaton_type &) {
+        }
+
+        void save(binary_writer &) const {
+        }
+
+        void load(binary_reader &) {
+        }
+
+        bool consistent(std::size_t) const { // with an automaton of that many states, after load().
+            return true;
+        }
+
+        template<typename automaton_type>
+        typename automaton_type::index_type lookupchild(const automaton_type &automaton,
+                                                        typename automaton_type::index_type cur_state,
+                                                        const CharType &character) const {
+            return automaton.lookup_label(cur_state, character);
+        }
+
+        void prefetch(std::uint32_t) const { // the labels are only known once the node is loaded.
+        }
+
+        std::size_t memory_usage() const {
+            return 0;
+        }
+    };
+
+    // full dfa for byte alphabets: every goto/fail transition is resolved ahead of time into a table with one row per
+    // state, so scanning costs exactly one lookup per byte. bytes that occur in no pattern behave identically in every
+    // state and share a single column (alphabet compression), which keeps rows short for text dictionaries. bytes with
+    // the same representative in the symbol map share a column as well.
+    // rows cost 4 bytes per column, so only the states that come first in breadth-first order (the shallow ones, where a
+    // scan spends most of its time) get one, as long as the table stays below max_table_bytes. the deeper states keep
+    // their children and failure link, a lookup there follows failure links up to a state with a row.
+    template<typename CharType, std::size_t max_table_bytes>
+    class dense_transitions {
+        static_assert(sizeof(CharType) == 1, "dense_transitions requires a byte alphabet");
+
+    public:
+        static const bool complete = true;
+
+        struct sparse_state {
+            std::uint32_t first_child;
+            std::uint32_t child_count;
+            std::uint32_t failure;
+        };
+
+    private:
+        flat_array<std::uint32_t> d_table;
+        flat_array<sparse_state> d_sparse; // of the states from d_row_count on.
+        flat_array<unsigned char> d_sparse_class; // the column of the label of those states.
+        unsigned char d_class[256];
+        std::size_t d_class_count;
+        std::size_t d_row_count;
+
+    public:
+        static const char *name() {
+            return "dense";
+        }
+
+        dense_transitions() :
+                d_table(),
+                d_sparse(),
+                d_sparse_class(),
+                d_class(),
+                d_class_count(1),
+                d_row_count(0) {
+        }
+
+        template<typename automaton_type>
+        void build(const automaton_type &automaton) {
+            typedef typename automaton_type::index_type index_type;
+            std::fill(d_class, d_class + 256, 0); // class 0: bytes absent from all patterns.
+            for (index_type child = 1; child < automaton.size(); ++child) {
+                d_class[static_cast<unsigned char>(automaton.labels()[child])] = 1;
+            }
+            d_class_count = 1;
+            for (std::size_t b = 0; b < 256; ++b) {
+                if (d_class[b]) {
+                    d_class[b] = static_cast<unsigned char>(d_class_count++);
+                }
+            }
+            d_row_count = std::max<std::size_t>(1, std::min<std::size_t>(automaton.size(), max_table_bytes / (d_class_count * sizeof(std::uint32_t))));
+
+            std::vector<std::uint32_t> table(d_row_count * d_class_count, 0);
+            for (index_type s = 0; s < d_row_count; ++s) {
+                std::uint32_t *row = table.data() + s * d_class_count;
+                if (s != 0) { // failure states come earlier in breadth-first order, so their rows are complete.
+                    const std::uint32_t *failure_row = table.data() + automaton.nodes()[s].failure * d_class_count;
+                    std::copy(failure_row, failure_row + d_class_count, row);
+                }
+                const auto &n = automaton.nodes()[s];
+                for (index_type child = n.first_child; child < n.first_child + n.child_count; ++child) {
+                    row[d_class[static_cast<unsigned char>(automaton.labels()[child])]] = child;
+                }
+            }
+            d_table = flat_array<std::uint32_t>(std::move(table));
+            std::vector<sparse_state> sparse;
+            std::vector<unsigned char> sparse_class;
+            for (std::size_t s = d_row_count; s < automaton.size(); ++s) {
+                const auto &n = automaton.nodes()[s];
+                sparse.push_back(sparse_state{n.first_child, n.child_count, n.failure});
+                sparse_class.push_back(d_class[static_cast<unsigned char>(automaton.labels()[s])]);
+            }
+            d_sparse = flat_array<sparse_state>(std::move(sparse));
+            d_sparse_class = flat_array<unsigned char>(std::move(sparse_class));
+
+            // the labels are mapped symbols: a byte gets the column of its representative, scanning then needs no map.
+            unsigned char label_class[256];
+            std::memcpy(label_class, d_class, sizeof(d_class));
+            for (std::size_t b = 0; b < 256; ++b) {
+                d_class[b] = label_class[static_cast<unsigned char>(automaton.symbols()(static_cast<CharType>(b)))];
+            }
+        }
+
+        void save(binary_writer &w) const {
+            w.write_raw(d_class, sizeof(d_class));
+            w.write<std::uint64_t>(d_class_count);
+            w.write<std::uint64_t>(d_row_count);
+            w.write_array(d_sparse);
+            w.write_array(d_sparse_class);
+            w.write_array(d_table);
+        }
+
+        void load(binary_reader &r) {
+            std::memcpy(d_class, r.read_bytes(sizeof(d_class)), sizeof(d_class));
+            d_class_count = static_cast<std::size_t>(r.read<std::uint64_t>());
+            d_row_count = static_cast<std::size_t>(r.read<std::uint64_t>());
+            d_sparse = r.read_array<sparse_state>();
+            d_sparse_class = r.read_array<unsigned char>();
+            d_table = r.read_array<std::uint32_t>();
+        }
+
+        // besides the bounds, every failure link of a state without a row leads to an earlier state, so next() ends at a
+        // row.
+        bool consistent(std::size_t node_count) const {
+            if (d_class_count == 0 || d_class_count > 256 || d_row_count == 0 || d_row_count > node_count ||
+                d_table.size() / d_class_count != d_row_count || d_table.size() % d_class_count != 0 ||
+                d_sparse.size() != node_count - d_row_count || d_sparse_class.size() != d_sparse.size()) {
+                return false;
+            }
+            for (std::size_t b = 0; b < 256; ++b) {
+                if (d_class[b] >= d_class_count) {
+                    return false;
+                }
+            }
+            for (std::uint32_t target : d_table) {
+                if (target >= node_count) {
+                    return false;
+                }
+            }
+            for (std::size_t i = 0; i < d_sparse.size(); ++i) {
+                const sparse_state &s = d_sparse[i];
+                if (s.failure >= d_row_count + i || s.first_child <= d_row_count + i || s.first_child > node_count ||
+                    s.child_count > node_count - s.first_child || d_sparse_class[i] >= d_class_count) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        template<typename automaton_type>
+        typename automaton_type::index_type lookupchild(const automaton_type &automaton,
+                                                        typename automaton_type::index_type cur_state,
+                                                        const CharType &character) const {
+            return automaton.lookup_label(cur_state, character);
+        }
+
+        std::uint32_t next(std::uint32_t cur_state, const CharType &character) const {
+            const unsigned char column = d_class[static_cast<unsigned char>(character)];
+            while (cur_state >= d_row_count) {
+                const sparse_state &s = d_sparse[cur_state - d_row_count];
+                for (std::uint32_t child = s.first_child; child < s.first_child + s.child_count; ++child) {
+                    if (d_sparse_class[child - d_row_count] == column) {
+                        return child;
+                    }
+                }
+                cur_state = s.failure;
+            }
+            return d_table[cur_state * d_class_count + column];
+        }
+
+        std::size_t class_count() const {
+            return d_class_count;
+        }
+
+        std::size_t row_count() const {
+            return d_row_count;
+        }
+
+        void prefetch(std::uint32_t cur_state) const {
+            if (cur_state < d_row_count) {
+                AHO_CORASICK_PREFETCH(d_table.data() + cur_state * d_class_count);
+            } else {
+                AHO_CORASICK_PREFETCH(d_sparse.data() + (cur_state - d_row_count));
+            }
+        }
+
+        std::size_t memory_usage() const {
+            return d_table.memory_usage() + d_sparse.memory_usage() + d_sparse_class.memory_usage() + sizeof(d_class);
+        }
+    };
+
+    // double-array (base/check) trie for large alphabets such as wtrie: a child is found with a single probe at
+    // base[state] + code(character), where check tells whether the slot belongs to that state. characters are renumbered
+    // densely (most frequent first) through a two-level table, which keeps the arrays about as small as the sorted labels.
+    template<typename CharType>
+    class double_array_transitions {
+        static_assert(std::is_integral<CharType>::value, "double_array_transitions requires an integral character type");
+
+    public:
+        static const bool complete = false;
+
+        struct slot {
+            std::uint32_t check; // owning state, npos when free.
+            std::uint32_t target;
+        };
+
+    private:
+        typedef typename std::make_unsigned<CharType>::type unsigned_char_type;
+
+        flat_array<std::uint32_t> d_base;
+        flat_array<slot> d_slots;
+        flat_array<std::uint32_t> d_pages; // high bits of a character -> block in d_codes, block 0 maps everything to 0.
+        flat_array<std::uint32_t> d_codes; // blocks of 256 codes, 0 means the character occurs in no pattern.
+
+        static const std::uint32_t npos = std::uint32_t(-1);
+
+    public:
+        static const char *name() {
+            return "double_array";
+        }
+
+        double_array_transitions() :
+                d_base(),
+                d_slots(),
+                d_pages(),
+                d_codes(std::vector<std::uint32_t>(256, 0)) {
+        }
+
+        std::uint32_t code(const CharType &character) const {
+            const std::size_t c = static_cast<unsigned_char_type>(character);
+            const std::size_t page = c >> 8;
+            if (page >= d_pages.size()) {
+                return 0;
+            }
+            return d_codes[d_pages[page] + (c & 0xff)];
+        }
+
+        template<typename automaton_type>
+        void build(const automaton_type &automaton) {
+            typedef typename automaton_type::index_type index_type;
+            std::vector<std::pair<std::size_t, unsigned_char_type> > frequencies;
+            {
+                std::vector<unsigned_char_type> used;
+                for (index_type child = 1; child < automaton.size(); ++child) {
+                    used.push_back(static_cast<unsigned_char_type>(automaton.labels()[child]));
+                }
+                std::sort(used.begin(), used.end());
+                for (std::size_t i = 0; i < used.size();) {
+                    std::size_t j = i;
+                    while (j < used.size() && used[j] == used[i]) {
+                        ++j;
+                    }
+                    frequencies.push_back(std::make_pair(j - i, used[i]));
+                    i = j;
+                }
+                std::sort(frequencies.begin(), frequencies.end(),
+                          [](const std::pair<std::size_t, unsigned_char_type> &a, const std::pair<std::size_t, unsigned_char_type> &b) {
+                              return a.first > b.first || (a.first == b.first && a.second < b.second);
+                          });
+            }
+            std::vector<std::uint32_t> pages;
+            std::vector<std::uint32_t> codes_of(256, 0);
+            for (std::size_t i = 0; i < frequencies.size(); ++i) {
+                const std::size_t c = frequencies[i].second;
+                const std::size_t page = c >> 8;
+                if (page >= pages.size()) {
+                    pages.resize(page + 1, 0);
+                }
+                if (pages[page] == 0) {
+                    pages[page] = static_cast<std::uint32_t>(codes_of.size());
+                    codes_of.resize(codes_of.size() + 256, 0);
+                }
+                codes_of[pages[page] + (c & 0xff)] = static_cast<std::uint32_t>(i + 1);
+            }
+            d_pages = flat_array<std::uint32_t>(std::move(pages));
+            d_codes = flat_array<std::uint32_t>(std::move(codes_of));
+
+            std::vector<std::uint32_t> bases(automaton.size(), 0);
+            std::vector<slot> slots(frequencies.size() + 1, slot{npos, 0});
+            std::size_t first_free = 1;
+            std::vector<std::uint32_t> codes;
+            for (index_type s = 0; s < automaton.size(); ++s) {
+                const auto &n = automaton.nodes()[s];
+                if (!n.child_count) {
+                    continue;
+                }
+                codes.clear();
+                for (index_type child = n.first_child; child < n.first_child + n.child_count; ++child) {
+                    codes.push_back(code(automaton.labels()[child]));
+                }
+                std::sort(codes.begin(), codes.end());
+                while (first_free < slots.size() && slots[first_free].check != npos) {
+                    ++first_free;
+                }
+                // first fit: try to put the smallest code on a free slot, starting at the lowest free one.
+                std::size_t pos = std::max<std::size_t>(first_free, codes.front());
+                for (;; ++pos) {
+                    if (pos >= slots.size()) {
+                        break; // everything beyond the end is free.
+                    }
+                    if (slots[pos].check != npos) {
+                        continue;
+                    }
+                    const std::size_t base = pos - codes.front();
+                    bool fits = true;
+                    for (std::size_t k = 1; k < codes.size() && fits; ++k) {
+                        fits = base + codes[k] >= slots.size() || slots[base + codes[k]].check == npos;
+                    }
+                    if (fits) {
+                        break;
+                    }
+                }
+                const std::size_t base = pos - codes.front();
+                if (base + codes.back() >= slots.size()) {
+                    slots.resize(base + codes.back() + 1, slot{npos, 0});
+                }
+                if (slots.size() >= npos) {
+                    throw std::length_error("aho_corasick::double_array_transitions: too many slots");
+                }
+                bases[s] = static_cast<std::uint32_t>(base);
+                for (index_type child = n.first_child; child < n.first_child + n.child_count; ++child) {
+                    slots[base + code(automaton.labels()[child])] = slot{s, child};
+                }
+            }
+            d_base = flat_array<std::uint32_t>(std::move(bases));
+            d_slots = flat_array<slot>(std::move(slots));
+        }
+
+        void save(binary_writer &w) const {
+            w.write_array(d_base);
+            w.write_array(d_slots);
+            w.write_array(d_pages);
+            w.write_array(d_codes);
+        }
+
+        void load(binary_reader &r) {
+            d_base = r.read_array<std::uint32_t>();
+            d_slots = r.read_array<slot>();
+            d_pages = r.read_array<std::uint32_t>();
+            d_codes = r.read_array<std::uint32_t>();
+        }
+
+        bool consistent(std::size_t node_count) const { // lookupchild() checks the slot positions itself.
+            if (d_base.size() != node_count || d_codes.size() < 256 || d_codes.size() % 256 != 0) {
+                return false;
+            }
+            for (const slot &s : d_slots) { // a slot is only used by its owner.
+                if (s.check < node_count && s.target >= node_count) {
+                    return false;
+                }
+            }
+            for (std::size_t page = 0; page < d_pages.size(); ++page) { // one per 256 characters up to the largest used.
+                if (d_pages[page] % 256 != 0 || d_pages[page] >= d_codes.size()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        template<typename automaton_type>
+        typename automaton_type::index_type lookupchild(const automaton_type &,
+                                                        typename automaton_type::index_type cur_state,
+                                                        const CharType &character) const {
+            const std::uint32_t c = code(character);
+            if (!c) {
+                return automaton_type::npos;
+            }
+            const std::size_t pos = d_base[cur_state] + c;
+            if (pos >= d_slots.size() || d_slots[pos].check != cur_state) {
+                return automaton_type::npos;
+            }
+            return d_slots[pos].target;
+        }
+
+        void prefetch(std::uint32_t cur_state) const {
+            AHO_CORASICK_PREFETCH(d_base.data() + cur_state);
+        }
+
+        std::size_t slot_count() const {
+            return d_slots.size();
+        }
+
+        std::size_t memory_usage() const {
+            return d_base.memory_usage()
+                   + d_slots.memory_usage()
+                   + d_pages.memory_usage()
+                   + d_codes.memory_usage();
+        }
+    };
+
+    template<typename CharType>
+    const std::uint32_t double_array_transitions<CharType>::npos;
+
+    // iterators over contiguous memory, the prefilter below may look at the underlying bytes directly.
+    template<typename iteratortype, typename CharType>
+    struct is_contiguous_iterator : std::integral_constant<bool,
+            std::is_same<iteratortype, const CharType *>::value ||
+            std::is_same<iteratortype, CharType *>::value ||
+            std::is_same<iteratortype, typename std::vector<CharType>::const_iterator>::value ||
+            std::is_same<iteratortype, typename std::vector<CharType>::iterator>::value
+#ifndef AHO_CORASICK_NOEXTRAS
+            || std::is_same<iteratortype, typename std::basic_string<CharType>::const_iterator>::value
+            || std::is_same<iteratortype, typename std::basic_string<CharType>::iterator>::value
+#endif
+    > {
+    };
+
+    // skips input while the automaton sits in the root: finds the next byte that can start a pattern. only worth it when
+    // few distinct bytes start a pattern, for larger sets (or an empty pattern matching everywhere) it stays disabled.
+    // the vector width is chosen at runtime: avx2 when the cpu has it, sse2 otherwise, scalar on other architectures.
+    class start_byte_prefilter {
+    public:
+        static const std::size_t max_bytes = 8;
+
+    private:
+        typedef const unsigned char *(*find_function)(const unsigned char *, const unsigned char *, const start_byte_prefilter &);
+
+        unsigned char d_bytes[max_bytes];
+        std::size_t d_count;
+        bool d_starts[256];
+        find_function d_find;
+
+    public:
+        start_byte_prefilter() :
+                d_bytes(),
+                d_count(0),
+                d_starts(),
+                d_find(nullptr) {
+        }
+
+        template<typename automaton_type>
+        void build(const automaton_type &automaton) {
+            typedef typename automaton_type::index_type index_type;
+            typedef typename automaton_type::CharType char_type;
+            d_find = nullptr;
+            const auto &root = automaton.nodes()[automaton.root()];
+            if (root.output != automaton_type::npos || root.child_count > max_bytes) {
+                return;
+            }
+            bool labels[256] = {};
+            for (index_type child = root.first_child; child < root.first_child + root.child_count; ++child) {
+                labels[static_cast<unsigned char>(automaton.labels()[child])] = true;
+            }
+            d_count = 0;
+            for (std::size_t b = 0; b < 256; ++b) { // the bytes whose representative starts a pattern.
+                d_starts[b] = labels[static_cast<unsigned char>(automaton.symbols()(static_cast<char_type>(b)))];
+                if (d_starts[b]) {
+                    if (d_count == max_bytes) {
+                        return;
+                    }
+                    d_bytes[d_count++] = static_cast<unsigned char>(b);
+                }
+            }
+            d_find = &find_scalar;
+#ifdef AHO_CORASICK_X86_SIMD
+            d_find = __builtin_cpu_supports("avx2") ? &find_avx2 : &find_sse2;
+#endif
+        }
+
+        bool enabled() const {
+            return d_find != nullptr;
+        }
+
+        // first position in [begin, end) holding a byte that starts a pattern, end if there is none.
+        const unsigned char *find(const unsigned char *begin, const unsigned char *end) const {
+            return d_find(begin, end, *this);
+        }
+
+    private:
+        static const unsigned char *find_scalar(const unsigned char *begin, const unsigned char *end, const start_byte_prefilter &f) {
+            while (begin != end && !f.d_starts[*begin]) {
+                ++begin;
+            }
+            return begin;
+        }
+
+#ifdef AHO_CORASICK_X86_SIMD
+
+        __attribute__((target("sse2")))
+        static const unsigned char *find_sse2(const unsigned char *begin, const unsigned char *end, const start_byte_prefilter &f) {
+            __m128i needles[max_bytes];
+            for (std::size_t k = 0; k < f.d_count; ++k) {
+                needles[k] = _mm_set1_epi8(static_cast<char>(f.d_bytes[k]));
+            }
+            for (; end - begin >= 16; begin += 16) {
+                const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+                __m128i hit = _mm_setzero_si128();
+                for (std::size_t k = 0; k < f.d_count; ++k) {
+                    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, needles[k]));
+                }
+                const int mask = _mm_movemask_epi8(hit);
+                if (mask) {
+                    return begin + __builtin_ctz(static_cast<unsigned>(mask));
+                }
+            }
+            return find_scalar(begin, end, f);
+        }
+
+        __attribute__((target("avx2")))
+        static const unsigned char *find_avx2(const unsigned char *begin, const unsigned char *end, const start_byte_prefilter &f) {
+            __m256i needles[max_bytes];
+            for (std::size_t k = 0; k < f.d_count; ++k) {
+                needles[k] = _mm256_set1_epi8(static_cast<char>(f.d_bytes[k]));
+            }
+            for (; end - begin >= 32; begin += 32) {
+                const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+                __m256i hit = _mm256_setzero_si256();
+                for (std::size_t k = 0; k < f.d_count; ++k) {
+                    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, needles[k]));
+                }
+                const int mask = _mm256_movemask_epi8(hit);
+                if (mask) {
+                    return begin + __builtin_ctz(static_cast<unsigned>(mask));
+                }
+            }
+            return find_scalar(begin, end, f);
+        }
+
+#endif
+    };
+
+    // immutable automaton compiled from a basic_trie. states are numbered breadth-first and stored in contiguous arrays,
+    // so the children of a state occupy a consecutive range of indices and no per-state heap allocations remain.
+    template<typename string_type, typename value_type, typename transitions, typename symbol_map>
+    class compiled_trie {
+    public:
+        using CharType = typename string_type::value_type;
+
+        typedef string_type pattern_type;
+        typedef value_type payload_type;
+        typedef symbol_map symbol_map_type;
+        typedef std::uint32_t index_type;
+        typedef begin_end_value<value_type> BeginEndValue;
+
+        static const index_type npos = index_type(-1);
+
+        struct node {
+            index_type first_child; // children are sorted on their label and numbered consecutively.
+            index_type child_count;
+            index_type failure;
+            index_type output; // nearest state on the failure chain (this one included) that carries a payload, npos if none.
+        };
+
+        static const std::size_t batch_lanes = 8; // documents collect_batch walks at the same time.
+
+        static const std::uint32_t file_version = 5; // 2: values are numbered in pattern (mapping) order, 3: symbol map, 4: leftmost links,
+                                                     // 5: dense rows for the shallow states only.
+
+    private:
+        flat_array<node> d_nodes;
+        flat_array<CharType> d_labels; // character on the edge leading into each state, the root's entry is unused.
+        flat_array<index_type> d_depth;
+        flat_array<index_type> d_value_index; // npos for states without payload.
+        flat_array<leftmost_links<index_type> > d_leftmost; // npos for none.
+        flat_array<value_type> d_values;
+        std::size_t d_max_depth;
+        symbol_map d_symbols;
+        transitions d_transitions;
+        start_byte_prefilter d_prefilter; // only built for byte alphabets.
+        std::shared_ptr<const void> d_storage; // keeps the memory alive the arrays refer to when loaded from a file.
+
+    public:
+        compiled_trie() :
+                d_nodes(std::vector<node>(1, node{1, 0, 0, npos})),
+                d_labels(std::vector<CharType>(1)),
+                d_depth(std::vector<index_type>(1, 0)),
+                d_value_index(std::vector<index_type>(1, npos)),
+                d_leftmost(std::vector<leftmost_links<index_type> >(1, leftmost_links<index_type>{npos, npos, npos, npos, npos})),
+                d_values(),
+                d_max_depth(0),
+                d_symbols(),
+                d_transitions(),
+                d_prefilter(),
+                d_storage() {
+            d_transitions.build(*this);
+        }
+
+        template<typename storage_type>
+        explicit compiled_trie(const basic_trie<string_type, value_type, storage_type, symbol_map> &trie) :
+                compiled_trie(no_states()) {
+            typedef typename basic_trie<string_type, value_type, storage_type, symbol_map>::state_ptr_type state_ptr_type;
+            d_symbols = trie.symbols();
+            std::vector<node> nodes;
+            std::vector<CharType> labels;
+            std::vector<index_type> depth;
+            std::vector<index_type> value_index;
+            std::vector<value_type> values;
+            std::vector<std::pair<std::size_t, index_type> > patterns; // pattern id, state.
+            std::vector<state_ptr_type> order(1, trie.root()); // breadth-first, doubles as the queue.
+            labels.push_back(CharType());
+            for (std::size_t i = 0; i < order.size(); ++i) {
+                state_ptr_type cur_state = order[i];
+                nodes.push_back(node{static_cast<index_type>(order.size()),
+                                     static_cast<index_type>(cur_state->d_success.size()),
+                                     0,
+                                     npos});
+                depth.push_back(static_cast<index_type>(cur_state->depth));
+                d_max_depth = std::max(d_max_depth, cur_state->depth);
+                if (cur_state->payload) {
+                    patterns.push_back(std::make_pair(cur_state->pattern_id, static_cast<index_type>(i)));
+                }
+                value_index.push_back(npos);
+                for (const auto &char_child : cur_state->d_success) {
+                    order.push_back(char_child.second.get());
+                    labels.push_back(char_child.first);
+                }
+            }
+            if (order.size() >= npos) {
+                throw std::length_error("aho_corasick::compiled_trie: too many states");
+            }
+            std::sort(patterns.begin(), patterns.end()); // the value index doubles as the leftmost_first priority.
+            values.reserve(patterns.size());
+            for (const auto &pattern : patterns) {
+                value_index[pattern.second] = static_cast<index_type>(values.size());
+                values.push_back(*order[pattern.second]->payload);
+            }
+            d_nodes = flat_array<node>(std::move(nodes));
+            d_labels = flat_array<CharType>(std::move(labels));
+            d_depth = flat_array<index_type>(std::move(depth));
+            d_value_index = flat_array<index_type>(std::move(value_index));
+            d_values = flat_array<value_type>(std::move(values));
+            construct_failure_states();
+            construct_leftmost_links();
+            d_transitions.build(*this);
+            if (sizeof(CharType) == 1) {
+                d_prefilter.build(*this);
+            }
+        }
+
+        // writes the automaton in a versioned binary format that load() can use in place. payloads are written through
+        // serializer, see payload_serializer.
+        template<typename serializer = payload_serializer<value_type> >
+        void save(std::ostream &os) const {
+            static_assert(std::is_trivially_copyable<CharType>::value, "saving requires a trivially copyable character type");
+            binary_writer w(os);
+            write_header<serializer>(w);
+            w.write<std::uint64_t>(d_max_depth);
+            w.write_array(d_nodes);
+            w.write_array(d_labels);
+            w.write_array(d_depth);
+            w.write_array(d_value_index);
+            w.write_array(d_leftmost);
+            save_values<serializer>(w, std::integral_constant<bool, serializer::mappable>());
+            d_symbols.save(w);
+            d_transitions.save(w);
+            if (!os) {
+                throw std::runtime_error("aho_corasick::compiled_trie: writing the automaton failed");
+            }
+        }
+
+        template<typename serializer = payload_serializer<value_type> >
+        void save(const std::string &path) const {
+            std::ofstream os(path.c_str(), std::ios::binary);
+            if (!os) {
+                throw std::runtime_error("aho_corasick::compiled_trie: cannot create " + path);
+            }
+            save<serializer>(os);
+        }
+
+        // uses an automaton written by save() straight from memory: the arrays (and mappable payloads) refer to data,
+        // which storage has to keep alive. only payloads that are not mappable get deserialized.
+        template<typename serializer = payload_serializer<value_type> >
+        static compiled_trie load(std::shared_ptr<const void> storage, const char *data, std::size_t size) {
+            compiled_trie result{no_states()};
+            binary_reader r(data, size);
+            result.template read_header<serializer>(r);
+            result.d_max_depth = static_cast<std::size_t>(r.read<std::uint64_t>());
+            result.d_nodes = r.read_array<node>();
+            result.d_labels = r.read_array<CharType>();
+            result.d_depth = r.read_array<index_type>();
+            result.d_value_index = r.read_array<index_type>();
+            result.d_leftmost = r.read_array<leftmost_links<index_type> >();
+            result.template load_values<serializer>(r, std::integral_constant<bool, serializer::mappable>());
+            result.d_symbols.load(r);
+            result.d_transitions.load(r);
+            if (!result.consistent()) {
+                throw std::runtime_error("aho_corasick::compiled_trie: inconsistent automaton file");
+            }
+            result.d_storage = std::move(storage);
+            if (sizeof(CharType) == 1) {
+                result.d_prefilter.build(result);
+            }
+            return result;
+        }
+
+#ifdef AHO_CORASICK_MMAP
+
+        // maps the file and uses it in place, load time does not depend on the size of the automaton.
+        template<typename serializer = payload_serializer<value_type> >
+        static compiled_trie load(const std::string &path) {
+            std::shared_ptr<mapped_file> file = std::make_shared<mapped_file>(path);
+            const char *data = file->map(0, file->file_size(), MADV_NORMAL);
+            return load<serializer>(file, data, file->length());
+        }
+
+#endif
+
+        std::size_t size() const {
+            return d_nodes.size();
+        }
+
+        std::size_t pattern_count() const {
+            return d_values.size();
+        }
+
+        std::size_t max_depth() const {
+            return d_max_depth;
+        }
+
+        std::size_t memory_usage() const { // heap memory, an automaton used in place from a mapped file needs (almost) none.
+            return d_nodes.memory_usage()
+                   + d_labels.memory_usage()
+                   + d_depth.memory_usage()
+                   + d_value_index.memory_usage()
+                   + d_leftmost.memory_usage()
+                   + d_values.memory_usage()
+                   + d_transitions.memory_usage();
+        }
+
+        const start_byte_prefilter &prefilter() const {
+            return d_prefilter;
+        }
+
+        const transitions &transition_table() const {
+            return d_transitions;
+        }
+
+        const flat_array<node> &nodes() const {
+            return d_nodes;
+        }
+
+        const flat_array<CharType> &labels() const {
+            return d_labels;
+        }
+
+        const symbol_map &symbols() const {
+            return d_symbols;
+        }
+
+        index_type root() const {
+            return 0;
+        }
+
+        index_type lookupchild(index_type cur_state, const CharType &character) const {
+            return d_transitions.lookupchild(*this, cur_state, character);
+        }
+
+        void prefetch(index_type cur_state) const {
+            AHO_CORASICK_PREFETCH(d_nodes.data() + cur_state);
+            d_transitions.prefetch(cur_state);
+        }
+
+        const value_type &value(index_type pattern) const { // of a match_record.
+            return d_values[pattern];
+        }
+
+        index_type lookup_label(index_type cur_state, const CharType &character) const {
+            const node &n = d_nodes[cur_state];
+            const CharType *first = d_labels.data() + n.first_child;
+            const CharType *last = first + n.child_count;
+            if (n.child_count > 8) {
+                first = std::lower_bound(first, last, character);
+            } else {
+                while (first != last && *first < character) {
+                    ++first;
+                }
+            }
+            if (first == last || !(*first == character)) {
+                return npos;
+            }
+            return n.first_child + static_cast<index_type>(first - (d_labels.data() + n.first_child));
+        }
+
+        index_type get_state(index_type cur_state, const CharType &c) const {
+            return get_state(cur_state, c, std::integral_constant<bool, transitions::complete>());
+        }
+
+        template<typename callbackfct>
+        bool iterate_outputs(index_type cur_state, const callbackfct &fct) const { // fct(const value_type &, std::size_t depth)
+            for (index_type o = d_nodes[cur_state].output; o != npos; o = o ? d_nodes[d_nodes[o].failure].output : npos) {
+                AHO_CORASICK_COUNT(matches, 1);
+                if (!fct(d_values[d_value_index[o]], static_cast<std::size_t>(d_depth[o]))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::vector<BeginEndValue> collect_matches(const string_type &v) const {
+            return collect_matches(v.begin(), v.end());
+        }
+
+        template<typename iteratortype>
+        std::vector<BeginEndValue> collect_matches(const iteratortype &begin, const iteratortype &end) const {
+            std::vector<BeginEndValue> hits;
+            collect_matches(begin, end, hits);
+            return hits;
+        }
+
+        // resumable scan: continues from cur_state with *begin at absolute offset pos, reports fct(value, begin offset,
+        // end offset) and leaves cur_state/pos behind the last consumed symbol. returns false when fct asked to stop.
+        template<typename iteratortype, typename callbackfct>
+        bool scan(index_type &cur_state, std::size_t &pos, const iteratortype &begin, const iteratortype &end, const callbackfct &fct) const {
+            for (auto i = begin; i != end; ++i) {
+                if (cur_state == 0 && d_prefilter.enabled()) {
+                    pos += skip_to_candidate(i, end);
+                    if (i == end) {
+                        break;
+                    }
+                }
+                cur_state = get_state(cur_state, *i);
+                const std::size_t e = ++pos;
+                bool go_on = iterate_outputs(cur_state, [&fct, e](const value_type &v, std::size_t depth) {
+                    return fct(v, e - depth, e);
+                });
+                if (!go_on) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // the matches of kind, see match_kind.
+        template<typename iteratortype>
+        std::vector<BeginEndValue> collect_matches(const iteratortype &begin, const iteratortype &end, match_kind kind) const {
+            std::vector<BeginEndValue> hits;
+            collect_matches(begin, end, hits, kind);
+            return hits;
+        }
+
+        std::vector<BeginEndValue> collect_matches(const string_type &v, match_kind kind) const {
+            return collect_matches(v.begin(), v.end(), kind);
+        }
+
+        // appends the matches to sink instead of returning a new vector: a sink that is cleared and reused between scans
+        // keeps its capacity, so scanning stops allocating once it has grown.
+        template<typename iteratortype>
+        void collect_matches(const iteratortype &begin,
+                             const iteratortype &end,
+                             std::vector<BeginEndValue> &sink,
+                             match_kind kind = match_kind::overlapping) const {
+            scan_matches(*this, kind, begin, end, [&sink](const value_type &v, std::size_t b, std::size_t e) {
+                sink.push_back(BeginEndValue{b, e, v});
+                return true;
+            });
+        }
+
+        void collect_matches(const string_type &v, std::vector<BeginEndValue> &sink, match_kind kind = match_kind::overlapping) const {
+            collect_matches(v.begin(), v.end(), sink, kind);
+        }
+
+        // the same as compact records that do not refer into the automaton (see value()). offsets have to fit in 32 bits.
+        template<typename iteratortype>
+        void collect_matches(const iteratortype &begin,
+                             const iteratortype &end,
+                             std::vector<match_record> &sink,
+                             match_kind kind = match_kind::overlapping) const {
+            const value_type *values = d_values.data();
+            scan_matches(*this, kind, begin, end, [&sink, values](const value_type &v, std::size_t b, std::size_t e) {
+                if (e >= npos) {
+                    throw std::length_error("aho_corasick::compiled_trie: match offset too large for a match_record");
+                }
+                sink.push_back(match_record{static_cast<std::uint32_t>(b), static_cast<std::uint32_t>(e), static_cast<std::uint32_t>(&v - values)});
+                return true;
+            });
+        }
+
+        void collect_matches(const string_type &v, std::vector<match_record> &sink, match_kind kind = match_kind::overlapping) const {
+            collect_matches(v.begin(), v.end(), sink, kind);
+        }
+
+        std::size_t state_depth(index_type cur_state) const {
+            return d_depth[cur_state];
+        }
+
+        // the longest match ending in cur_state, priority is its value index.
+        bool longest_output(index_type cur_state, const value_type *&v, std::size_t &depth, std::size_t &priority) const {
+            const index_type o = d_nodes[cur_state].output;
+            if (o == npos) {
+                return false;
+            }
+            priority = d_value_index[o];
+            v = &d_values[priority];
+            depth = d_depth[o];
+            return true;
+        }
+
+        // moves i to the next symbol that can start a pattern, returns how many symbols were skipped.
+        template<typename iteratortype>
+        std::size_t skip_to_candidate(iteratortype &i, const iteratortype &end) const {
+            if (!d_prefilter.enabled()) {
+                return 0;
+            }
+            return skip_to_candidate(i, end, std::integral_constant<bool, sizeof(CharType) == 1 && is_contiguous_iterator<iteratortype, CharType>::value>());
+        }
+
+        void check_construct_failure_states() const { // the constructors build everything.
+        }
+
+        void check_construct_leftmost_links() const {
+        }
+
+        index_type null_state() const {
+            return npos;
+        }
+
+        index_type state_failure(index_type cur_state) const {
+            return d_nodes[cur_state].failure;
+        }
+
+        const value_type &state_payload(index_type cur_state) const {
+            return d_values[d_value_index[cur_state]];
+        }
+
+        const leftmost_links<index_type> &leftmost(index_type cur_state) const {
+            return d_leftmost[cur_state];
+        }
+
+        bool has_output(index_type cur_state) const {
+            return d_nodes[cur_state].output != npos;
+        }
+
+        template<typename callbackfct>
+        void iterate_pattern_ids(index_type cur_state, const callbackfct &fct) const { // fct(std::size_t value index)
+            for (index_type o = d_nodes[cur_state].output; o != npos; o = o ? d_nodes[d_nodes[o].failure].output : npos) {
+                AHO_CORASICK_COUNT(matches, 1);
+                fct(d_value_index[o]);
+            }
+        }
+
+        std::size_t pattern_id_count() const {
+            return d_values.size();
+        }
+
+        template<typename iteratortype>
+        bool contains_any(const iteratortype &begin, const iteratortype &end) const {
+            return aho_corasick::contains_any(*this, begin, end);
+        }
+
+        bool contains_any(const string_type &s) const {
+            return contains_any(s.begin(), s.end());
+        }
+
+        template<typename iteratortype>
+        const value_type *find_first(const iteratortype &begin,
+                                     const iteratortype &end,
+                                     std::size_t *match_begin = nullptr,
+                                     std::size_t *match_end = nullptr) const {
+            return aho_corasick::find_first(*this, begin, end, match_begin, match_end);
+        }
+
+        const value_type *find_first(const string_type &s, std::size_t *match_begin = nullptr, std::size_t *match_end = nullptr) const {
+            return find_first(s.begin(), s.end(), match_begin, match_end);
+        }
+
+        template<typename iteratortype>
+        std::size_t count_matches(const iteratortype &begin, const iteratortype &end) const {
+            return aho_corasick::count_matches(*this, begin, end);
+        }
+
+        std::size_t count_matches(const string_type &s) const {
+            return count_matches(s.begin(), s.end());
+        }
+
+        template<typename iteratortype>
+        std::size_t count_pattern_matches(const iteratortype &begin, const iteratortype &end, std::vector<std::size_t> &histogram) const {
+            return aho_corasick::count_pattern_matches(*this, begin, end, histogram);
+        }
+
+        std::size_t count_pattern_matches(const string_type &s, std::vector<std::size_t> &histogram) const {
+            return count_pattern_matches(s.begin(), s.end(), histogram);
+        }
+
+        // matches every document in [first, last) (containers of characters, such as strings) into batch, replacing its
+        // contents. documents are walked in groups of batch_lanes, one symbol of each in turn: the next state of a
+        // document is prefetched while the others take their step, so the cache misses of the group overlap instead of
+        // adding up. a document has to be shorter than 4G symbols.
+        template<typename documentiterator>
+        void collect_batch(documentiterator first, const documentiterator &last, match_batch &batch) const {
+            typedef typename std::iterator_traits<documentiterator>::value_type document_type;
+            typedef typename document_type::const_iterator iteratortype;
+            struct lane {
+                iteratortype pos;
+                iteratortype end;
+                index_type state;
+                std::uint32_t offset;
+                bool entered; // state was just entered, its outputs are not reported yet.
+                std::vector<match_record> *matches; // owned by the batch.
+            };
+            lane lanes[batch_lanes];
+            std::vector<match_record> *buffers = batch.lanes(batch_lanes);
+            batch.clear();
+            while (first != last) {
+                std::size_t group = 0;
+                for (; group < batch_lanes && first != last; ++group, ++first) {
+                    const document_type &document = *first;
+                    if (static_cast<std::size_t>(std::distance(document.begin(), document.end())) >= npos) {
+                        throw std::length_error("aho_corasick::compiled_trie: document too long for a match_batch");
+                    }
+                    lanes[group].pos = document.begin();
+                    lanes[group].end = document.end();
+                    lanes[group].state = 0;
+                    lanes[group].offset = 0;
+                    lanes[group].entered = false;
+                    lanes[group].matches = &buffers[group];
+                    lanes[group].matches->clear();
+                }
+                for (bool busy = true; busy;) {
+                    busy = false;
+                    for (std::size_t l = 0; l < group; ++l) {
+                        lane &cur = lanes[l];
+                        if (cur.entered) { // the node was prefetched a round ago.
+                            for (index_type o = d_nodes[cur.state].output; o != npos; o = o ? d_nodes[d_nodes[o].failure].output : npos) {
+                                AHO_CORASICK_COUNT(matches, 1);
+                                cur.matches->push_back(match_record{cur.offset - d_depth[o], cur.offset, d_value_index[o]});
+                            }
+                            cur.entered = false;
+                            busy = true;
+                        }
+                        if (cur.pos == cur.end) {
+                            continue;
+                        }
+                        cur.state = get_state(cur.state, *cur.pos);
+                        prefetch(cur.state);
+                        ++cur.pos;
+                        ++cur.offset;
+                        cur.entered = true;
+                        busy = true;
+                    }
+                }
+                for (std::size_t l = 0; l < group; ++l) {
+                    batch.append_document(*lanes[l].matches);
+                }
+            }
+        }
+
+        template<typename documentiterator>
+        match_batch collect_batch(const documentiterator &first, const documentiterator &last) const {
+            match_batch batch;
+            collect_batch(first, last, batch);
+            return batch;
+        }
+
+        stream_matcher<compiled_trie> stream(match_kind kind = match_kind::overlapping) const {
+            return stream_matcher<compiled_trie>(*this, kind);
+        }
+
+        template<typename iteratortype, typename callbackfct>
+        void iterate_matches(const iteratortype &begin,
+                             const iteratortype &end,
+                             const callbackfct &fct) const {
+            index_type cur_state = 0;
+            match_begin_finder<iteratortype> finder(d_max_depth);
+            for (auto i = begin; i != end;) {
+                if (cur_state == 0) {
+                    skip_to_candidate(i, end); // only skips random access input, the finder does not miss symbols.
+                    if (i == end) {
+                        break;
+                    }
+                }
+                finder.push(i);
+                cur_state = get_state(cur_state, *i);
+                ++i;
+                const iteratortype &posend = i;
+                bool go_on = iterate_outputs(cur_state, [&fct, &finder, &posend](const value_type &v, std::size_t depth) {
+                    return fct(v, finder.begin(posend, depth), posend);
+                });
+                if (!go_on) {
+                    return;
+                }
+            }
+        }
+
+        template<typename callbackfct>
+        void iterate_matches(const string_type &s,
+                             const callbackfct &fct) const {
+            iterate_matches(s.begin(), s.end(), fct);
+        }
+
+        // same result as collect_matches, computed on threads (0: one per core) for random access input.
+        template<typename iteratortype>
+        std::vector<BeginEndValue> parallel_collect_matches(const iteratortype &begin, const iteratortype &end, std::size_t threads = 0) const {
+            return aho_corasick::parallel_collect_matches(*this, begin, end, threads);
+        }
+
+        std::vector<BeginEndValue> parallel_collect_matches(const string_type &v, std::size_t threads = 0) const {
+            return parallel_collect_matches(v.begin(), v.end(), threads);
+        }
+
+    private:
+        struct no_states {
+        };
+
+        explicit compiled_trie(no_states) :
+                d_nodes(),
+                d_labels(),
+                d_depth(),
+                d_value_index(),
+                d_leftmost(),
+                d_values(),
+                d_max_depth(0),
+                d_symbols(),
+                d_transitions(),
+                d_prefilter(),
+                d_storage() {
+        }
+
+        template<typename serializer>
+        void write_header(binary_writer &w) const {
+            char name[16] = {};
+            std::strncpy(name, transitions::name(), sizeof(name) - 1);
+            char symbols_name[16] = {};
+            std::strncpy(symbols_name, symbol_map::name(), sizeof(symbols_name) - 1);
+            w.write_raw("AHOCORAS", 8);
+            w.write<std::uint32_t>(file_version);
+            w.write<std::uint32_t>(0x01020304); // byte order.
+            w.write<std::uint32_t>(sizeof(CharType));
+            w.write<std::uint32_t>(sizeof(index_type));
+            w.write<std::uint32_t>(serializer::mappable ? sizeof(value_type) : 0);
+            w.write_raw(name, sizeof(name));
+            w.write_raw(symbols_name, sizeof(symbols_name));
+        }
+
+        template<typename serializer>
+        void read_header(binary_reader &r) {
+            char name[16] = {};
+            std::strncpy(name, transitions::name(), sizeof(name) - 1);
+            char symbols_name[16] = {};
+            std::strncpy(symbols_name, symbol_map::name(), sizeof(symbols_name) - 1);
+            if (std::memcmp(r.read_bytes(8), "AHOCORAS", 8) != 0) {
+                throw std::runtime_error("aho_corasick::compiled_trie: not an automaton file");
+            }
+            if (r.read<std::uint32_t>() != file_version) {
+                throw std::runtime_error("aho_corasick::compiled_trie: unsupported automaton file version");
+            }
+            if (r.read<std::uint32_t>() != 0x01020304 ||
+                r.read<std::uint32_t>() != sizeof(CharType) ||
+                r.read<std::uint32_t>() != sizeof(index_type) ||
+                r.read<std::uint32_t>() != (serializer::mappable ? sizeof(value_type) : 0) ||
+                std::memcmp(r.read_bytes(sizeof(name)), name, sizeof(name)) != 0 ||
+                std::memcmp(r.read_bytes(sizeof(symbols_name)), symbols_name, sizeof(symbols_name)) != 0) {
+                throw std::runtime_error("aho_corasick::compiled_trie: automaton file does not match this automaton type");
+            }
+        }
+
+        template<typename serializer>
+        void save_values(binary_writer &w, std::true_type) const {
+            w.write_array(d_values);
+        }
+
+        template<typename serializer>
+        void save_values(binary_writer &w, std::false_type) const {
+            w.write<std::uint64_t>(d_values.size());
+            for (const auto &v : d_values) {
+                serializer::write(w, v);
+            }
+        }
+
+        template<typename serializer>
+        void load_values(binary_reader &r, std::true_type) {
+            d_values = r.read_array<value_type>();
+        }
+
+        template<typename serializer>
+        void load_values(binary_reader &r, std::false_type) {
+            std::vector<value_type> values;
+            const std::size_t count = static_cast<std::size_t>(r.read<std::uint64_t>());
+            values.reserve(std::min<std::size_t>(count, 1 << 20));
+            for (std::size_t i = 0; i < count; ++i) {
+                values.push_back(serializer::read(r));
+            }
+            d_values = flat_array<value_type>(std::move(values));
+        }
+
+        template<typename iteratortype>
+        std::size_t skip_to_candidate(iteratortype &, const iteratortype &, std::false_type) const {
+            return 0;
+        }
+
+        template<typename iteratortype>
+        std::size_t skip_to_candidate(iteratortype &i, const iteratortype &end, std::true_type) const {
+            const unsigned char *first = reinterpret_cast<const unsigned char *>(&*i);
+            const std::size_t skipped = d_prefilter.find(first, first + (end - i)) - first;
+            AHO_CORASICK_COUNT(skipped_symbols, skipped);
+            i += skipped;
+            return skipped;
+        }
+
+        index_type get_state(index_type cur_state, const CharType &c, std::true_type) const {
+            AHO_CORASICK_COUNT(symbols, 1);
+            AHO_CORASICK_COUNT(states_visited, 1); // the failure links are folded into the table.
+            return d_transitions.next(cur_state, c);
+        }
+
+        index_type get_state(index_type cur_state, const CharType &c, std::false_type) const {
+            AHO_CORASICK_COUNT(symbols, 1);
+            const CharType symbol = d_symbols(c);
+            for (;;) {
+                AHO_CORASICK_COUNT(states_visited, 1);
+                index_type result = lookupchild(cur_state, symbol);
+                if (result != npos) {
+                    return result;
+                }
+                if (cur_state == 0) {
+                    return 0;
+                }
+                cur_state = d_nodes[cur_state].failure;
+                AHO_CORASICK_COUNT(failure_hops, 1);
+            }
+        }
+
+        void construct_failure_states() {
+            // breadth-first numbering guarantees that failure states (being shallower) are finished before they are used.
+            for (index_type s = 0; s < d_nodes.size(); ++s) {
+                const node &n = d_nodes[s];
+                for (index_type child = n.first_child; child < n.first_child + n.child_count; ++child) {
+                    index_type trace_failure_state = s;
+                    index_type target = 0;
+                    while (trace_failure_state != 0) {
+                        trace_failure_state = d_nodes[trace_failure_state].failure;
+                        target = lookup_label(trace_failure_state, d_labels[child]);
+                        if (target != npos) {
+                            break;
+                        }
+                        target = 0;
+                    }
+                    d_nodes.mutable_data()[child].failure = target;
+                }
+                if (d_value_index[s] != npos) {
+                    d_nodes.mutable_data()[s].output = s;
+                } else if (s != 0) {
+                    d_nodes.mutable_data()[s].output = d_nodes[d_nodes[s].failure].output;
+                }
+            }
+        }
+
+        // whether every index a scan follows stays inside its array and every link it walks leads to a shallower state (the
+        // pattern links of a state may lead to itself), so an automaton from a damaged file cannot make a scan read out of
+        // bounds or loop. one pass over the states and the transitions.
+        bool consistent() const {
+            const std::size_t n = d_nodes.size();
+            if (n == 0 || d_labels.size() != n || d_depth.size() != n || d_value_index.size() != n || d_leftmost.size() != n ||
+                d_depth[0] != 0 || !d_transitions.consistent(n)) {
+                return false;
+            }
+            auto pattern_state = [&](index_type t, std::size_t depth) {
+                return t == npos || (t < n && d_depth[t] <= depth && d_value_index[t] != npos);
+            };
+            auto shallower = [&](index_type t, std::size_t depth) {
+                return t == npos || (t < n && d_depth[t] < depth);
+            };
+            auto shallower_prefix = [&](index_type t, std::size_t depth) {
+                return shallower(t, depth) && (t == npos || d_leftmost[t].longest != npos);
+            };
+            std::size_t children = 0;
+            for (std::size_t s = 0; s < n; ++s) {
+                const node &x = d_nodes[s];
+                const std::size_t depth = d_depth[s];
+                if (depth > d_max_depth || x.failure >= n || (s != 0 && d_depth[x.failure] >= depth) || !pattern_state(x.output, depth) ||
+                    (d_value_index[s] != npos && d_value_index[s] >= d_values.size()) ||
+                    x.first_child > n || x.child_count > n - x.first_child || (children += x.child_count) >= n) {
+                    return false;
+                }
+                for (index_type child = x.first_child; child < x.first_child + x.child_count; ++child) {
+                    if (d_depth[child] != depth + 1) {
+                        return false;
+                    }
+                }
+                const leftmost_links<index_type> &l = d_leftmost[s];
+                if (!pattern_state(l.longest, depth) || !pattern_state(l.first, depth) || (l.longest == npos) != (l.first == npos) ||
+                    !shallower_prefix(l.prefix_link, depth) || !shallower_prefix(l.gap, depth) || !shallower(l.gap_next, depth)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void construct_leftmost_links() { // breadth-first again: parents and failure states come first.
+            std::vector<leftmost_links<index_type> > links(d_nodes.size(), leftmost_links<index_type>{npos, npos, npos, npos, npos});
+            auto links_of = [&links](index_type s) -> const leftmost_links<index_type> & {
+                return links[s];
+            };
+            auto depth_of = [this](index_type s) {
+                return d_depth[s];
+            };
+            auto priority_of = [this](index_type s) {
+                return d_value_index[s];
+            };
+            for (index_type s = 0; s < d_nodes.size(); ++s) {
+                const node &n = d_nodes[s];
+                for (index_type child = n.first_child; child < n.first_child + n.child_count; ++child) {
+                    links[child] = derive_leftmost_links(child, s, d_nodes[child].failure, d_value_index[child] != npos, npos, links_of, depth_of, priority_of);
+                }
+            }
+            d_leftmost = flat_array<leftmost_links<index_type> >(std::move(links));
+        }
+    };
+
+    template<typename string_type, typename value_type, typename transitions, typename symbol_map>
+    const typename compiled_trie<string_type, value_type, transitions, symbol_map>::index_type compiled_trie<string_type, value_type, transitions, symbol_map>::npos;
+
+    template<typename string_type, typename value_type, typename transitions, typename symbol_map>
+    const std::uint32_t compiled_trie<string_type, value_type, transitions, symbol_map>::file_version;
+
+    template<typename string_type, typename value_type, typename transitions, typename symbol_map>
+    const std::size_t compiled_trie<string_type, value_type, transitions, symbol_map>::batch_lanes;
+
+    // matches a stream that arrives in chunks (packets, file blocks) without copying or keeping earlier chunks: it
+    // remembers the automaton state and the absolute offset, so a match spanning chunks is reported when its last chunk
+    // arrives, with begin/end offsets relative to the start of the stream. the automaton must outlive the matcher.
+    template<typename automaton_type>
+    class stream_matcher {
+    public:
+        typedef typename automaton_type::pattern_type string_type;
+        typedef typename automaton_type::payload_type value_type;
+        typedef typename automaton_type::BeginEndValue BeginEndValue;
+        typedef decltype(std::declval<const automaton_type &>().root()) state_id_type;
+
+    private:
+        const automaton_type *d_automaton;
+        match_kind d_kind;
+        state_id_type d_state;
+        std::size_t d_offset;
+
+    public:
+        // overlapping or non_overlapping matches, see scan_stream. the leftmost kinds throw std::invalid_argument.
+        explicit stream_matcher(const automaton_type &automaton, match_kind kind = match_kind::overlapping) :
+                d_automaton(&automaton),
+                d_kind(kind),
+                d_state(automaton.root()),
+                d_offset(0) {
+            if (kind != match_kind::overlapping && kind != match_kind::non_overlapping) {
+                throw std::invalid_argument("aho_corasick::stream_matcher: the leftmost match kinds cannot be found in a stream");
+            }
+        }
+
+        // fct(const value_type &, std::size_t begin, std::size_t end) -> bool, returning false stops the scan right
+        // after the symbol that completed the match; feed() then returns false and the rest of the chunk is dropped.
+        template<typename iteratortype, typename callbackfct>
+        bool feed(const iteratortype &begin, const iteratortype &end, const callbackfct &fct) {
+            return scan_stream(*d_automaton, d_kind, d_state, d_offset, begin, end, fct);
+        }
+
+        template<typename callbackfct>
+        bool feed(const string_type &chunk, const callbackfct &fct) {
+            return feed(chunk.begin(), chunk.end(), fct);
+        }
+
+#ifdef AHO_CORASICK_MMAP
+
+        // feeds a whole file through a sliding memory mapping, see iterate_file_matches.
+        template<typename callbackfct>
+        bool feed_file(const std::string &path, const callbackfct &fct) {
+            return scan_file(*d_automaton, d_state, d_offset, path, fct, d_kind);
+        }
+
+#endif
+
+        template<typename iteratortype>
+        std::vector<BeginEndValue> collect_matches(const iteratortype &begin, const iteratortype &end) {
+            std::vector<BeginEndValue> hits;
+            feed(begin, end, [&hits](const value_type &v, std::size_t b, std::size_t e) {
+                hits.push_back(BeginEndValue{b, e, v});
+                return true;
+            });
+            return hits;
+        }
+
+        std::vector<BeginEndValue> collect_matches(const string_type &chunk) {
+            return collect_matches(chunk.begin(), chunk.end());
+        }
+
+        std::size_t offset() const { // symbols consumed so far.
+            return d_offset;
+        }
+
+        void reset() {
+            d_state = d_automaton->root();
+            d_offset = 0;
+        }
+    };
+
+#ifdef AHO_CORASICK_MMAP
+
+    // scans a file through a mapping that slides over it in windows, so the bytes are never copied and the memory in use
+    // does not grow with the file size. continues from cur_state/pos like scan_stream(), so the leftmost match kinds
+    // throw std::invalid_argument. byte alphabets only.
+    template<typename automaton_type, typename state_id_type, typename callbackfct>
+    bool scan_file(const automaton_type &automaton,
+                   state_id_type &cur_state,
+                   std::size_t &pos,
+                   const std::string &path,
+                   const callbackfct &fct,
+                   match_kind kind = match_kind::overlapping,
+                   std::size_t window_size = std::size_t(64) << 20) {
+        typedef typename automaton_type::pattern_type::value_type CharType;
+        static_assert(sizeof(CharType) == 1, "scanning files requires a byte alphabet");
+        mapped_file file(path);
+        window_size = std::max(mapped_file::page_size(), window_size / mapped_file::page_size() * mapped_file::page_size());
+        for (std::size_t offset = 0; offset < file.file_size(); offset += window_size) {
+            const CharType *window = reinterpret_cast<const CharType *>(file.map(offset, window_size));
+            if (!scan_stream(automaton, kind, cur_state, pos, window, window + file.length(), fct)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // fct(const value_type &, std::size_t begin, std::size_t end) with file offsets, returning false stops the scan.
+    template<typename automaton_type, typename callbackfct>
+    bool iterate_file_matches(const automaton_type &automaton,
+                              const std::string &path,
+                              const callbackfct &fct,
+                              match_kind kind = match_kind::overlapping) {
+        auto cur_state = automaton.root();
+        std::size_t pos = 0;
+        return scan_file(automaton, cur_state, pos, path, fct, kind);
+    }
+
+    template<typename automaton_type>
+    std::vector<typename automaton_type::BeginEndValue> collect_file_matches(const automaton_type &automaton,
+                                                                             const std::string &path,
+                                                                             match_kind kind = match_kind::overlapping) {
+        typedef typename automaton_type::BeginEndValue BeginEndValue;
+        std::vector<BeginEndValue> hits;
+        iterate_file_matches(automaton, path, [&hits](const typename automaton_type::payload_type &v, std::size_t b, std::size_t e) {
+            hits.push_back(BeginEndValue{b, e, v});
+            return true;
+        }, kind);
+        return hits;
+    }
+
+    // chunked parallel scan of a file (0 threads: one per core), every worker maps only the chunk it is scanning.
+    template<typename automaton_type>
+    std::vector<typename automaton_type::BeginEndValue> parallel_collect_file_matches(const automaton_type &automaton,
+                                                                                      const std::string &path,
+                                                                                      std::size_t threads = 0) {
+        typedef typename automaton_type::BeginEndValue BeginEndValue;
+        typedef typename automaton_type::payload_type value_type;
+        typedef typename automaton_type::pattern_type::value_type CharType;
+        static_assert(sizeof(CharType) == 1, "scanning files requires a byte alphabet");
+        const std::size_t file_size = mapped_file(path).file_size();
+        return parallel_scan_chunks<BeginEndValue>(
+                file_size,
+                automaton.max_depth() ? automaton.max_depth() - 1 : 0,
+                threads,
+                std::size_t(64) << 20,
+                [&](std::size_t scan_begin, std::size_t chunk_begin, std::size_t chunk_end, std::vector<BeginEndValue> &hits) {
+                    mapped_file file(path);
+                    const std::size_t map_begin = scan_begin / mapped_file::page_size() * mapped_file::page_size();
+                    const CharType *window = reinterpret_cast<const CharType *>(file.map(map_begin, chunk_end - map_begin));
+                    auto cur_state = automaton.root();
+                    std::size_t pos = scan_begin;
+                    automaton.scan(cur_state, pos, window + (scan_begin - map_begin), window + (chunk_end - map_begin),
+                                   [&hits, chunk_begin](const value_type &v, std::size_t b, std::size_t e) {
+                                       if (e > chunk_begin) {
+                                           hits.push_back(BeginEndValue{b, e, v});
+                                       }
+                                       return true;
+                                   });
+                });
+    }
+
+#endif
+
 #ifndef AHO_CORASICK_NOEXTRAS
     typedef basic_trie<std::basic_string<char>, std::basic_string<char> > trie;
     typedef basic_trie<std::basic_string<wchar_t>, std::basic_string<wchar_t> > wtrie;
@@ -0,0 +1,254 @@
+#include "aho_corasick.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// throughput, latency and memory per corpus, backend and mode. every measurement is printed as one json object per
+// line on stdout, so results can be collected and compared over time:
+//   bench_aho_corasick [word list (default bench_words)] [--quick]
+
+typedef std::chrono::steady_clock bench_clock;
+
+double seconds_since(const bench_clock::time_point &start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+struct corpus {
+    std::string name;
+    std::vector<std::string> patterns;
+    std::string text;
+};
+
+struct build_stats {
+    std::string backend;
+    double build_s; // mapping the patterns into the trie (the source trie for the compiled backends).
+    double failure_s; // building the failure links of that trie.
+    double compile_s; // compiling it, 0 for the trie backends.
+    std::size_t states;
+    double bytes_per_state;
+};
+
+struct scan_stats {
+    std::string mode;
+    double seconds;
+    std::size_t matches;
+    double p50_us;
+    double p99_us;
+};
+
+std::vector<std::string> read_word_list(const std::string &path) {
+    std::ifstream in(path.c_str());
+    std::vector<std::string> words;
+    std::string word;
+    while (std::getline(in, word)) {
+        if (!word.empty()) {
+            words.push_back(word);
+        }
+    }
+    return words;
+}
+
+// the dictionary itself, and a text of random dictionary words: nearly every position ends a match.
+corpus words_corpus(const std::vector<std::string> &words, std::size_t text_size, std::mt19937 &rng) {
+    corpus c;
+    c.name = "words";
+    c.patterns = words;
+    std::uniform_int_distribution<std::size_t> pick(0, words.size() - 1);
+    while (c.text.size() < text_size) {
+        c.text += words[pick(rng)];
+        c.text += ' ';
+    }
+    return c;
+}
+
+// random patterns over an alphabet of the given size, and random text over the same alphabet in which patterns are
+// planted until they cover the given fraction of it.
+corpus synthetic_corpus(const std::string &name,
+                        std::size_t alphabet,
+                        std::size_t min_length,
+                        std::size_t max_length,
+                        std::size_t pattern_count,
+                        double planted,
+                        std::size_t text_size,
+                        std::mt19937 &rng) {
+    corpus c;
+    c.name = name;
+    std::uniform_int_distribution<int> symbol(0, static_cast<int>(alphabet) - 1);
+    std::uniform_int_distribution<std::size_t> length(min_length, max_length);
+    const char first = alphabet <= 26 ? 'a' : 0;
+    for (std::size_t i = 0; i < pattern_count; ++i) {
+        std::string pattern(length(rng), first);
+        for (auto &ch : pattern) {
+            ch = static_cast<char>(first + symbol(rng));
+        }
+        c.patterns.push_back(pattern);
+    }
+    c.text.resize(text_size);
+    for (auto &ch : c.text) {
+        ch = static_cast<char>(first + symbol(rng));
+    }
+    std::uniform_int_distribution<std::size_t> pick(0, pattern_count - 1);
+    std::uniform_int_distribution<std::size_t> where(0, text_size - max_length);
+    for (std::size_t covered = 0; covered < planted * text_size;) {
+        const std::string &pattern = c.patterns[pick(rng)];
+        std::copy(pattern.begin(), pattern.end(), c.text.begin() + where(rng));
+        covered += pattern.size();
+    }
+    return c;
+}
+
+double percentile_us(std::vector<double> &samples, double fraction) {
+    if (samples.empty()) {
+        return 0;
+    }
+    const std::size_t index = std::min(samples.size() - 1, static_cast<std::size_t>(fraction * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index] * 1e6;
+}
+
+// runs scan_call(begin, end) -> matches over the text in calls of call_size bytes, each timed on its own.
+template<typename scanfct>
+scan_stats measure(const std::string &mode, const std::string &text, std::size_t call_size, const scanfct &scan_call) {
+    scan_stats stats{mode, 0, 0, 0, 0};
+    std::vector<double> latencies;
+    latencies.reserve(text.size() / call_size + 1);
+    const auto start = bench_clock::now();
+    for (std::size_t offset = 0; offset < text.size(); offset += call_size) {
+        const auto call_start = bench_clock::now();
+        stats.matches += scan_call(text.begin() + offset, text.begin() + std::min(text.size(), offset + call_size));
+        latencies.push_back(seconds_since(call_start));
+    }
+    stats.seconds = seconds_since(start);
+    stats.p50_us = percentile_us(latencies, 0.5);
+    stats.p99_us = percentile_us(latencies, 0.99);
+    return stats;
+}
+
+void report(const corpus &c, const build_stats &build, const scan_stats &scan) {
+    const double mb = c.text.size() / 1e6;
+    std::ostringstream oss;
+    oss << "{\"corpus\":\"" << c.name << "\""
+        << ",\"backend\":\"" << build.backend << "\""
+        << ",\"mode\":\"" << scan.mode << "\""
+        << ",\"patterns\":" << c.patterns.size()
+        << ",\"text_bytes\":" << c.text.size()
+        << ",\"states\":" << build.states
+        << ",\"build_s\":" << build.build_s
+        << ",\"failure_s\":" << build.failure_s
+        << ",\"compile_s\":" << build.compile_s
+        << ",\"bytes_per_state\":" << build.bytes_per_state
+        << ",\"mb_per_s\":" << (scan.seconds > 0 ? mb / scan.seconds : 0)
+        << ",\"matches\":" << scan.matches
+        << ",\"matches_per_s\":" << (scan.seconds > 0 ? scan.matches / scan.seconds : 0)
+        << ",\"p50_us\":" << scan.p50_us
+        << ",\"p99_us\":" << scan.p99_us
+        << "}";
+    std::cout << oss.str() << std::endl;
+}
+
+template<typename automaton_type>
+void bench_modes(const corpus &c, const build_stats &build, const automaton_type &automaton, std::size_t call_size) {
+    typedef std::string::const_iterator iteratortype;
+    std::vector<typename automaton_type::BeginEndValue> sink;
+    report(c, build, measure("overlapping", c.text, call_size, [&](iteratortype begin, iteratortype end) {
+        sink.clear();
+        automaton.collect_matches(begin, end, sink);
+        return sink.size();
+    }));
+    report(c, build, measure("leftmost_longest", c.text, call_size, [&](iteratortype begin, iteratortype end) {
+        sink.clear();
+        automaton.collect_matches(begin, end, sink, aho_corasick::match_kind::leftmost_longest);
+        return sink.size();
+    }));
+    report(c, build, measure("count", c.text, call_size, [&](iteratortype begin, iteratortype end) {
+        return automaton.count_matches(begin, end);
+    }));
+}
+
+template<typename transitions>
+void bench_compiled(const corpus &c,
+                    const aho_corasick::basic_trie<std::string, std::size_t> &trie,
+                    double build_s,
+                    double failure_s,
+                    std::size_t call_size) {
+    const auto start = bench_clock::now();
+    const auto compiled = trie.compile<transitions>();
+    const build_stats build{std::string("compiled_") + transitions::name(),
+                            build_s,
+                            failure_s,
+                            seconds_since(start),
+                            compiled.size(),
+                            static_cast<double>(compiled.memory_usage()) / compiled.size()};
+    bench_modes(c, build, compiled, call_size);
+}
+
+void bench_corpus(const corpus &c, std::size_t call_size) {
+    std::cerr << "corpus " << c.name << ": " << c.patterns.size() << " patterns, " << c.text.size() << " bytes" << std::endl;
+    auto start = bench_clock::now();
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t i = 0; i < c.patterns.size(); ++i) {
+        trie.map(c.patterns[i], i);
+    }
+    const double build_s = seconds_since(start);
+    start = bench_clock::now();
+    trie.construct_failure_states();
+    const double failure_s = seconds_since(start);
+    const aho_corasick::trie_statistics heap_stats = trie.statistics();
+
+    aho_corasick::basic_trie<std::string, std::size_t, aho_corasick::arena_storage> arena_trie;
+    start = bench_clock::now();
+    for (std::size_t i = 0; i < c.patterns.size(); ++i) {
+        arena_trie.map(c.patterns[i], i);
+    }
+    const double arena_build_s = seconds_since(start);
+    start = bench_clock::now();
+    arena_trie.construct_failure_states();
+    const double arena_failure_s = seconds_since(start);
+    const aho_corasick::trie_statistics arena_stats = arena_trie.statistics();
+
+    bench_modes(c, build_stats{"trie", build_s, failure_s, 0, heap_stats.states,
+                               static_cast<double>(heap_stats.total_bytes()) / heap_stats.states}, trie, call_size);
+    bench_modes(c, build_stats{"trie_arena", arena_build_s, arena_failure_s, 0, arena_stats.states,
+                               static_cast<double>(arena_stats.total_bytes()) / arena_stats.states}, arena_trie, call_size);
+    bench_compiled<aho_corasick::sorted_transitions<char> >(c, trie, build_s, failure_s, call_size);
+    bench_compiled<aho_corasick::dense_transitions<char> >(c, trie, build_s, failure_s, call_size);
+    bench_compiled<aho_corasick::double_array_transitions<char> >(c, trie, build_s, failure_s, call_size);
+}
+
+int main(int argc, char **argv) {
+    std::string word_list = "bench_words";
+    bool quick = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else {
+            word_list = argv[i];
+        }
+    }
+    const std::size_t text_size = quick ? (1 << 20) : (16 << 20);
+    const std::size_t call_size = 4096; // one request.
+    std::mt19937 rng(19);
+
+    std::vector<std::string> words = read_word_list(word_list);
+    if (words.empty()) {
+        std::cerr << "no word list at " << word_list << ", only synthetic corpora" << std::endl;
+    } else {
+        if (quick && words.size() > 50000) {
+            words.resize(50000);
+        }
+        bench_corpus(words_corpus(words, text_size, rng), call_size);
+    }
+    bench_corpus(synthetic_corpus("dna_sparse", 4, 12, 24, 10000, 0.001, text_size, rng), call_size);
+    bench_corpus(synthetic_corpus("ascii_sparse", 26, 6, 12, 10000, 0.001, text_size, rng), call_size);
+    bench_corpus(synthetic_corpus("ascii_dense", 26, 3, 6, 10000, 0.2, text_size, rng), call_size);
+    bench_corpus(synthetic_corpus("binary", 256, 4, 8, 10000, 0.01, text_size, rng), call_size);
+    return 0;
+}
@@ -12,8 +12,36 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <forward_list>
+#include <list>
+#include <map>
+#include <new>
+#include <set>
 #include <stdio.h>
 #include <string.h>
+#include <thread>
+
+std::atomic<std::size_t> allocations(0); // to check that scanning into reused sinks does not allocate.
+
+void *operator new(std::size_t size) {
+    ++allocations;
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    free(p);
+}
 
 inline std::string read_from_file(char const *infile) {
     std::ifstream instream(infile);
@@ -33,6 +61,38 @@ void writeToFile(const std::string file, const std::string &s) {
     }
 }
 
+std::vector<std::string> read_words(std::size_t limit) {
+    std::string words_uncut = read_from_file("words");
+    std::vector<std::string> words;
+    std::istringstream iss(words_uncut);
+    std::string word;
+    while (words.size() < limit && std::getline(iss, word)) {
+        if (!word.empty()) {
+            words.push_back(word);
+        }
+    }
+    if (words.empty()) { // no word list next to the binary: distinct made up words, so the tests still run.
+        std::set<std::string> seen;
+        std::uint32_t x = 1;
+        while (words.size() < std::min<std::size_t>(limit, 20000)) {
+            x = x * 1103515245 + 12345;
+            std::string made_up(3 + (x >> 16) % 8, 'a');
+            for (auto &c : made_up) {
+                x = x * 1103515245 + 12345;
+                c = 'a' + (x >> 16) % 26;
+            }
+            if (seen.insert(made_up).second) {
+                words.push_back(made_up);
+            }
+        }
+    }
+    return words;
+}
+
+double seconds_since(const std::chrono::steady_clock::time_point &start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
 void test0() {
     aho_corasick::trie trie;
     trie.insert("ah");
@@ -143,10 +203,1419 @@ void test3() {
 }
 
 
+void test4() {
+    aho_corasick::trie trie;
+    trie.insert("hers");
+    trie.insert("his");
+    trie.insert("she");
+    trie.insert("he");
+    const auto compiled = trie.compile();
+    assert(compiled.collect_matches("ushers") == trie.collect_matches("ushers"));
+    std::string mmm = "ushers";
+    std::vector<std::pair<std::size_t, std::size_t> > positions;
+    compiled.iterate_matches(mmm,
+                             [&](const std::string &,
+                                 const std::string::const_iterator &begin,
+                                 const std::string::const_iterator &end) {
+                                 positions.push_back(std::make_pair(begin - mmm.begin(), end - mmm.begin()));
+                                 return true;
+                             });
+    assert((positions == std::vector<std::pair<std::size_t, std::size_t> >{{1, 4}, {2, 4}, {2, 6}}));
+
+    std::vector<std::string> words = read_words(200000);
+    aho_corasick::basic_trie<std::string, std::size_t> big;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        big.map(words[i], i);
+    }
+    big.check_construct_failure_states();
+    auto start = std::chrono::steady_clock::now();
+    const auto big_compiled = big.compile();
+    std::cerr << "compiled " << big_compiled.size() << " states in " << seconds_since(start) << "s, "
+              << big_compiled.memory_usage() << " bytes" << std::endl;
+
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 7) {
+        text += words[i];
+        text += ' ';
+    }
+    start = std::chrono::steady_clock::now();
+    auto expected = big.collect_matches(text);
+    double trie_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    auto actual = big_compiled.collect_matches(text);
+    double compiled_time = seconds_since(start);
+    std::cerr << "scanned " << text.size() << " bytes: trie " << trie_time << "s, compiled " << compiled_time << "s" << std::endl;
+    assert(expected.size() == actual.size());
+    for (std::size_t i = 0; i < expected.size(); i++) {
+        assert(expected[i] == actual[i]);
+    }
+}
+
+void test5() {
+    aho_corasick::trie trie;
+    trie.insert("hers");
+    trie.insert("his");
+    trie.insert("she");
+    trie.insert("he");
+    trie.insert("\xe9t\xe9");
+    const auto dfa = trie.compile<aho_corasick::dense_transitions<char> >();
+    assert(dfa.transition_table().class_count() == 8);
+    assert(dfa.collect_matches("ushers \xe9t\xe9") == trie.collect_matches("ushers \xe9t\xe9"));
+
+    std::vector<std::string> words = read_words(200000);
+    aho_corasick::basic_trie<std::string, std::size_t> big;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        big.map(words[i], i);
+    }
+    auto start = std::chrono::steady_clock::now();
+    const auto sorted = big.compile();
+    double sorted_build = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    const auto dense = big.compile<aho_corasick::dense_transitions<char> >();
+    double dense_build = seconds_since(start);
+    std::cerr << "sorted: " << sorted_build << "s, " << sorted.memory_usage() << " bytes; dense: " << dense_build << "s, "
+              << dense.memory_usage() << " bytes, " << dense.transition_table().class_count() << " byte classes" << std::endl;
+
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 3) {
+        text += words[i];
+        text += ' ';
+    }
+    start = std::chrono::steady_clock::now();
+    auto expected = sorted.collect_matches(text);
+    double sorted_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    auto actual = dense.collect_matches(text);
+    double dense_time = seconds_since(start);
+    std::cerr << "scanned " << text.size() << " bytes: sorted " << sorted_time << "s, dense " << dense_time << "s" << std::endl;
+    assert(expected == actual);
+
+    // by default only the states that fit in 16 MB of rows get one, the others take 13 bytes.
+    const std::size_t row_bytes = dense.transition_table().class_count() * sizeof(std::uint32_t);
+    assert(dense.transition_table().row_count() == std::min<std::size_t>(dense.size(), (std::size_t(16) << 20) / row_bytes));
+    assert(dense.transition_table().memory_usage() <= (std::size_t(16) << 20) + 13 * dense.size() + 256);
+    (void) row_bytes;
+    const auto few_rows = big.compile<aho_corasick::dense_transitions<char, 4096> >();
+    assert(few_rows.collect_matches(text) == expected);
+    start = std::chrono::steady_clock::now();
+    const auto full = big.compile<aho_corasick::dense_transitions<char, std::size_t(-1)> >();
+    dense_build = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    actual = full.collect_matches(text);
+    dense_time = seconds_since(start);
+    std::cerr << "all " << full.size() << " rows: " << dense_build << "s, " << full.memory_usage() << " bytes, scanned in " << dense_time
+              << "s" << std::endl;
+    assert(full.transition_table().row_count() == full.size());
+    assert(expected == actual);
+}
+
+void test6() {
+    aho_corasick::wtrie trie;
+    trie.insert(L"hers");
+    trie.insert(L"his");
+    trie.insert(L"she");
+    trie.insert(L"\u00e9t\u00e9");
+    trie.insert(L"\u4e2d\u6587");
+    const auto da = trie.compile<aho_corasick::double_array_transitions<wchar_t> >();
+    const std::wstring text = L"ushers \u00e9t\u00e9 \u4e2d\u6587";
+    assert(da.collect_matches(text) == trie.collect_matches(text));
+
+    std::vector<std::string> words = read_words(200000);
+    aho_corasick::basic_trie<std::wstring, std::size_t> big;
+    std::wstring wtext;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        std::wstring w(words[i].begin(), words[i].end());
+        w += wchar_t(0x4e00 + i % 64);
+        big.map(w, i);
+        if (i % 3 == 0) {
+            wtext += w;
+            wtext += L' ';
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    const auto sorted = big.compile();
+    double sorted_build = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    const auto double_array = big.compile<aho_corasick::double_array_transitions<wchar_t> >();
+    double double_array_build = seconds_since(start);
+    std::cerr << "sorted: " << sorted_build << "s, " << sorted.memory_usage() << " bytes; double array: " << double_array_build << "s, "
+              << double_array.memory_usage() << " bytes, " << double_array.transition_table().slot_count() << " slots for "
+              << double_array.size() << " states" << std::endl;
+    start = std::chrono::steady_clock::now();
+    auto expected = sorted.collect_matches(wtext);
+    double sorted_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    auto actual = double_array.collect_matches(wtext);
+    double double_array_time = seconds_since(start);
+    std::cerr << "scanned " << wtext.size() << " characters: sorted " << sorted_time << "s, double array " << double_array_time << "s" << std::endl;
+    assert(expected == actual);
+}
+
+void test7() {
+    aho_corasick::trie trie;
+    trie.insert("error");
+    trie.insert("fatal");
+    trie.insert("panic: ");
+    trie.insert("\xff\xfe");
+    const auto compiled = trie.compile();
+    const auto dfa = trie.compile<aho_corasick::dense_transitions<char> >();
+    assert(compiled.prefilter().enabled() && dfa.prefilter().enabled());
+
+    std::string text;
+    for (std::size_t i = 0; text.size() < 4000000; i++) {
+        text += "the quick brown dog jumps over the lazy fox ";
+        if (i % 1000 == 999) {
+            text += i % 3 ? "error fatal" : "panic: \xff\xfe";
+        }
+    }
+    text += "erro";
+    for (std::size_t tail = 0; tail < 40; tail++) {
+        const std::string t = text.substr(text.size() - 100 + tail) + "fatal";
+        assert(compiled.collect_matches(t) == trie.collect_matches(t));
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto expected = trie.collect_matches(text);
+    double trie_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    auto actual = compiled.collect_matches(text);
+    double compiled_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    auto dfa_actual = dfa.collect_matches(text);
+    double dfa_time = seconds_since(start);
+    std::cerr << "low hit rate scan of " << text.size() << " bytes: trie " << trie_time << "s, prefiltered compiled " << compiled_time
+              << "s, prefiltered dense " << dfa_time << "s" << std::endl;
+    assert(expected == actual);
+    assert(expected == dfa_actual);
+
+    std::deque<char> not_contiguous(text.end() - 5000, text.end());
+    std::size_t count = 0;
+    compiled.iterate_matches(not_contiguous.begin(), not_contiguous.end(),
+                             [&count](const std::string &, const std::deque<char>::iterator &, const std::deque<char>::iterator &) {
+                                 ++count;
+                                 return true;
+                             });
+    assert(count == trie.collect_matches(std::string(text.end() - 5000, text.end())).size());
+}
+
+void test8() {
+    std::vector<std::string> words = read_words(50000);
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t i = 0; i < words.size(); i += 2) {
+        trie.map(words[i], i);
+    }
+    trie.map(std::string(300, 'x'), words.size()); // overlap longer than a few symbols.
+    const auto compiled = trie.compile();
+
+    std::string text;
+    for (std::size_t i = 0; text.size() < 8000000; i = (i + 7919) % words.size()) {
+        text += words[i];
+        text += i % 11 ? " " : std::string(301, 'x');
+    }
+    assert(trie.parallel_collect_matches(text.substr(0, 1000), 4) == trie.collect_matches(text.substr(0, 1000)));
+    auto start = std::chrono::steady_clock::now();
+    auto expected = compiled.collect_matches(text);
+    double sequential_time = seconds_since(start);
+    for (std::size_t threads = 1; threads <= 8; threads *= 2) {
+        start = std::chrono::steady_clock::now();
+        auto actual = compiled.parallel_collect_matches(text, threads);
+        std::cerr << "parallel scan with " << threads << " threads: " << seconds_since(start) << "s (sequential " << sequential_time << "s)" << std::endl;
+        assert(expected == actual);
+    }
+    assert(trie.parallel_collect_matches(text) == expected);
+}
+
+void test9() {
+    std::vector<std::string> words = read_words(20000);
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        trie.map(words[i], i);
+    }
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 5) {
+        text += words[i];
+    }
+    // the first scans race to build the failure links.
+    const auto &shared = trie;
+    std::vector<std::size_t> counts(4);
+    std::vector<std::thread> readers;
+    for (std::size_t t = 0; t < counts.size(); t++) {
+        readers.push_back(std::thread([&shared, &text, &counts, t]() {
+            counts[t] = shared.collect_matches(text).size();
+        }));
+    }
+    for (auto &r : readers) {
+        r.join();
+    }
+    for (std::size_t t = 1; t < counts.size(); t++) {
+        assert(counts[t] == counts[0]);
+    }
+
+    typedef aho_corasick::compiled_trie<std::string, std::size_t> compiled;
+    aho_corasick::published_automaton<compiled> published(std::make_shared<const compiled>(trie.compile()));
+    std::atomic<bool> done(false);
+    std::atomic<std::size_t> scans(0);
+    readers.clear();
+    for (std::size_t t = 0; t < 2; t++) {
+        readers.push_back(std::thread([&]() {
+            while (!done) {
+                const auto snapshot = published.snapshot();
+                const std::size_t expected = snapshot->pattern_count() == words.size() ? counts[0] : 0;
+                const std::size_t found = snapshot->collect_matches(text).size();
+                assert(expected == 0 || found == expected);
+                (void) found;
+                (void) expected;
+                scans++;
+            }
+        }));
+    }
+    for (std::size_t round = 0; round < 5; round++) {
+        aho_corasick::basic_trie<std::string, std::size_t> next;
+        for (std::size_t i = round; i < words.size(); i += 2) {
+            next.map(words[i], i);
+        }
+        published.publish(next.compile());
+        published.publish(trie.compile());
+    }
+    done = true;
+    for (auto &r : readers) {
+        r.join();
+    }
+    std::cerr << "scans during publishing: " << scans << std::endl;
+}
+
+void test10() {
+    aho_corasick::trie trie;
+    trie.insert("hers");
+    trie.insert("his");
+    trie.insert("she");
+    trie.insert("he");
+    trie.insert("ushers and his");
+    const auto compiled = trie.compile();
+    const std::string text = "ushers and his hers she";
+    const auto expected = trie.collect_matches(text);
+    for (std::size_t chunk_size = 1; chunk_size < 8; chunk_size++) {
+        auto trie_stream = trie.stream();
+        auto compiled_stream = compiled.stream();
+        std::vector<aho_corasick::trie::BeginEndValue> from_trie;
+        std::vector<aho_corasick::trie::BeginEndValue> from_compiled;
+        for (std::size_t i = 0; i < text.size(); i += chunk_size) {
+            const std::string chunk = text.substr(i, chunk_size); // the earlier chunks are gone by the time matches end.
+            for (const auto &hit : trie_stream.collect_matches(chunk)) {
+                from_trie.push_back(hit);
+            }
+            for (const auto &hit : compiled_stream.collect_matches(chunk)) {
+                from_compiled.push_back(hit);
+            }
+        }
+        assert(from_trie == expected);
+        assert(from_compiled == expected);
+        assert(compiled_stream.offset() == text.size());
+
+        auto non_overlapping_stream = compiled.stream(aho_corasick::match_kind::non_overlapping);
+        std::vector<aho_corasick::trie::BeginEndValue> non_overlapping;
+        for (std::size_t i = 0; i < text.size(); i += chunk_size) {
+            for (const auto &hit : non_overlapping_stream.collect_matches(text.substr(i, chunk_size))) {
+                non_overlapping.push_back(hit);
+            }
+        }
+        assert(non_overlapping == trie.collect_matches(text, aho_corasick::match_kind::non_overlapping));
+    }
+
+    auto stream = compiled.stream();
+    std::size_t hits = 0;
+    assert(stream.feed(std::string("ush"), [](const std::string &, std::size_t, std::size_t) { return true; }));
+    assert(!stream.feed(std::string("ers"), [&hits](const std::string &, std::size_t b, std::size_t e) {
+        assert(b == 1 || b == 2);
+        assert(e == 4);
+        return ++hits < 2;
+    }));
+    assert(hits == 2 && stream.offset() == 4);
+    (void) hits;
+    stream.reset();
+    assert(stream.collect_matches("he").size() == 1);
+}
+
+void test11() {
+    std::vector<std::string> words = read_words(20000);
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t i = 0; i < words.size(); i += 3) {
+        trie.map(words[i], i);
+    }
+    const auto compiled = trie.compile<aho_corasick::dense_transitions<char> >();
+    std::string text;
+    for (std::size_t i = 0; text.size() < 3000000; i = (i + 7919) % words.size()) {
+        text += words[i];
+        text += ' ';
+    }
+    writeToFile("/tmp/test11.txt", text);
+    const auto expected = compiled.collect_matches(text);
+    assert(aho_corasick::collect_file_matches(compiled, "/tmp/test11.txt") == expected);
+    assert(aho_corasick::collect_file_matches(trie, "/tmp/test11.txt") == expected);
+    assert(aho_corasick::parallel_collect_file_matches(compiled, "/tmp/test11.txt", 3) == expected);
+
+    std::vector<aho_corasick::basic_trie<std::string, std::size_t>::BeginEndValue> small_windows;
+    auto cur_state = compiled.root();
+    std::size_t pos = 0;
+    aho_corasick::scan_file(compiled, cur_state, pos, "/tmp/test11.txt", [&small_windows](const std::size_t &v, std::size_t b, std::size_t e) {
+        small_windows.push_back({b, e, v});
+        return true;
+    }, aho_corasick::match_kind::overlapping, 4096);
+    assert(small_windows.size() == expected.size() && pos == text.size());
+
+    auto stream = compiled.stream();
+    std::size_t hits = 0;
+    std::size_t last_end = 0;
+    auto count = [&hits, &last_end](const std::size_t &, std::size_t, std::size_t e) {
+        ++hits;
+        last_end = e;
+        return true;
+    };
+    stream.feed_file("/tmp/test11.txt", count);
+    stream.feed_file("/tmp/test11.txt", count);
+    assert(stream.offset() == 2 * text.size());
+    assert(hits >= 2 * expected.size() && last_end == text.size() + expected.back().end);
+
+    // non-overlapping matches carry over from one window to the next, the leftmost kinds cannot be streamed.
+    const auto non_overlapping = compiled.collect_matches(text, aho_corasick::match_kind::non_overlapping);
+    assert(aho_corasick::collect_file_matches(compiled, "/tmp/test11.txt", aho_corasick::match_kind::non_overlapping) == non_overlapping);
+    small_windows.clear();
+    cur_state = compiled.root();
+    pos = 0;
+    aho_corasick::scan_file(compiled, cur_state, pos, "/tmp/test11.txt", [&small_windows](const std::size_t &v, std::size_t b, std::size_t e) {
+        small_windows.push_back({b, e, v});
+        return true;
+    }, aho_corasick::match_kind::non_overlapping, 4096);
+    assert(small_windows == non_overlapping);
+    for (auto kind : {aho_corasick::match_kind::leftmost_first, aho_corasick::match_kind::leftmost_longest}) {
+        bool thrown = false;
+        try {
+            aho_corasick::collect_file_matches(trie, "/tmp/test11.txt", kind);
+        } catch (const std::invalid_argument &) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            compiled.stream(kind);
+        } catch (const std::invalid_argument &) {
+            thrown = true;
+        }
+        assert(thrown);
+        (void) thrown;
+    }
+
+    bool thrown = false;
+    try {
+        aho_corasick::collect_file_matches(compiled, "/tmp/does/not/exist");
+    } catch (const std::system_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    (void) thrown;
+}
+
+// a saved automaton ends with an array: its element count, padding up to 64 bytes, the elements. lowers the count by one.
+std::string drop_last_element(std::string image, std::size_t element_size) {
+    for (std::size_t p = image.size() - sizeof(std::uint64_t); p > 0; --p) {
+        std::uint64_t count;
+        std::memcpy(&count, image.data() + p, sizeof(count));
+        const std::size_t data = (p + sizeof(count) + 63) / 64 * 64;
+        if (count && data + count * element_size == image.size()) {
+            --count;
+            std::memcpy(&image[p], &count, sizeof(count));
+            break;
+        }
+    }
+    return image;
+}
+
+// overwrites the 32 bit index at offset in a saved automaton.
+std::string set_index(std::string image, std::size_t offset, std::uint32_t index) {
+    std::memcpy(&image[offset], &index, sizeof(index));
+    return image;
+}
+
+void test12() {
+    std::vector<std::string> words = read_words(50000);
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        trie.map(words[i], i);
+    }
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 3) {
+        text += words[i];
+    }
+    const auto compiled = trie.compile<aho_corasick::dense_transitions<char> >();
+    compiled.save("/tmp/test12.ac");
+    auto start = std::chrono::steady_clock::now();
+    const auto loaded = aho_corasick::compiled_trie<std::string, std::size_t, aho_corasick::dense_transitions<char> >::load("/tmp/test12.ac");
+    std::cerr << "loaded " << loaded.size() << " states in " << seconds_since(start) << "s, using " << loaded.memory_usage()
+              << " bytes of heap (compiled: " << compiled.memory_usage() << ")" << std::endl;
+    assert(loaded.memory_usage() < 1024);
+    assert(loaded.collect_matches(text) == compiled.collect_matches(text));
+
+    bool thrown = false;
+    try {
+        aho_corasick::compiled_trie<std::string, std::size_t>::load("/tmp/test12.ac"); // other transition policy.
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // payloads that are not trivially copyable are serialized, an unaligned buffer gets copied.
+    aho_corasick::wtrie wide;
+    wide.insert(L"hers");
+    wide.insert(L"his");
+    wide.insert(L"\u00e9t\u00e9");
+    const auto wide_compiled = wide.compile<aho_corasick::double_array_transitions<wchar_t> >();
+    std::ostringstream oss;
+    wide_compiled.save(oss);
+    const std::string image = " " + oss.str();
+    const auto wide_loaded = decltype(wide_compiled)::load(nullptr, image.data() + 1, image.size() - 1);
+    assert(wide_loaded.collect_matches(L"this \u00e9t\u00e9 hers") == wide_compiled.collect_matches(L"this \u00e9t\u00e9 hers"));
+
+    thrown = false;
+    try {
+        decltype(wide_compiled)::load(nullptr, image.data() + 1, image.size() / 2);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // one element less in the last array of the transitions: the file still parses, but does not fit the states.
+    std::ostringstream dense_oss;
+    compiled.save(dense_oss);
+    const std::string dense_image = drop_last_element(dense_oss.str(), sizeof(std::uint32_t));
+    thrown = false;
+    try {
+        decltype(compiled)::load(nullptr, dense_image.data(), dense_image.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    const std::string wide_image = drop_last_element(oss.str(), sizeof(std::uint32_t));
+    thrown = false;
+    try {
+        decltype(wide_compiled)::load(nullptr, wide_image.data(), wide_image.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // indices out of bounds: the output link of state 1 (the nodes start at offset 128, 16 bytes each) and the last
+    // target of the dense table.
+    aho_corasick::basic_trie<std::string, std::size_t> small;
+    small.map("he", 1);
+    small.map("she", 2);
+    const auto small_compiled = small.compile();
+    std::ostringstream small_oss;
+    small_compiled.save(small_oss);
+    const std::string small_image = small_oss.str();
+    assert(decltype(small_compiled)::load(nullptr, small_image.data(), small_image.size()).collect_matches("ushers") ==
+           small_compiled.collect_matches("ushers"));
+    const std::string bad_output = set_index(small_image, 128 + 16 + 12, 1000000);
+    thrown = false;
+    try {
+        decltype(small_compiled)::load(nullptr, bad_output.data(), bad_output.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    const std::string bad_failure = set_index(small_image, 128 + 16 + 8, 2); // a failure link to a state as deep.
+    thrown = false;
+    try {
+        decltype(small_compiled)::load(nullptr, bad_failure.data(), bad_failure.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    const std::string bad_target = set_index(dense_oss.str(), dense_oss.str().size() - sizeof(std::uint32_t), 1000000);
+    thrown = false;
+    try {
+        decltype(compiled)::load(nullptr, bad_target.data(), bad_target.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    (void) thrown;
+}
+
+struct counted {
+    static int alive;
+    std::string s;
+
+    counted(const std::string &s_ = std::string()) : s(s_) { ++alive; }
+
+    counted(const counted &o) : s(o.s) { ++alive; }
+
+    ~counted() { --alive; }
+
+    bool operator==(const counted &o) const { return s == o.s; }
+
+    bool operator<(const counted &o) const { return s < o.s; }
+};
+
+int counted::alive = 0;
+
+void test13() {
+    std::vector<std::string> words = read_words(200000);
+    auto start = std::chrono::steady_clock::now();
+    {
+        aho_corasick::basic_trie<std::string, std::size_t> heap;
+        for (std::size_t i = 0; i < words.size(); i++) {
+            heap.map(words[i], i);
+        }
+        double heap_build = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        {
+            aho_corasick::basic_trie<std::string, std::size_t, aho_corasick::arena_storage> arena;
+            for (std::size_t i = 0; i < words.size(); i++) {
+                arena.map(words[i], i);
+            }
+            double arena_build = seconds_since(start);
+            std::cerr << "build: heap " << heap_build << "s, arena " << arena_build << "s using " << arena.storage().memory_usage() << " bytes" << std::endl;
+            std::string text;
+            for (std::size_t i = 0; i < words.size(); i += 3) {
+                text += words[i];
+            }
+            assert(arena.collect_matches(text) == heap.collect_matches(text));
+            assert(arena.compile().collect_matches(text) == heap.collect_matches(text));
+            start = std::chrono::steady_clock::now();
+        }
+        double arena_teardown = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        heap = aho_corasick::basic_trie<std::string, std::size_t>();
+        std::cerr << "teardown: heap " << seconds_since(start) << "s, arena " << arena_teardown << "s" << std::endl;
+    }
+
+    {
+        aho_corasick::basic_trie<std::string, counted, aho_corasick::arena_storage> trie(aho_corasick::arena_storage(4096));
+        trie.map("hers", counted("a payload that does not fit the small string buffer"));
+        trie.map("hers", counted("replaced"));
+        trie.map("she", counted("she"));
+        std::string he("he");
+        trie.map(he.begin(), he.end(), [&trie](aho_corasick::arena_storage::pointer<counted> &p) {
+            p = trie.storage().create<counted>("he");
+        });
+        assert(trie.collect_matches("ushers").size() == 3);
+        auto moved = std::move(trie);
+        assert(moved.collect_matches("ushers").size() == 3);
+        assert(counted::alive == 4);
+    }
+    assert(counted::alive == 0);
+}
+
+void test14() {
+    // a long run of a's walks a failure chain as deep as the longest pattern, only its ends carry a payload.
+    const std::size_t depth = 2000;
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t k = 1; k <= depth; ++k) {
+        trie.map(std::string(k, 'a') + "b", k);
+    }
+    trie.map("a", 0);
+    const std::string text(100000, 'a');
+    auto start = std::chrono::steady_clock::now();
+    auto hits = trie.collect_matches(text);
+    std::cerr << "deep chain scan in " << seconds_since(start) << "s" << std::endl;
+    assert(hits.size() == text.size());
+
+    // payloads set or erased on existing states after a scan must show up in the next one.
+    trie.map(std::string(3, 'a'), 3);
+    hits = trie.collect_matches("aaaab");
+    assert(hits.size() == 4 + 2 + 4); // a, aaa, and ab up to aaaab.
+    assert(hits[6].v == 4 && hits[6].begin == 0 && hits[6].end == 5); // longest first.
+    trie.erase(std::string("a"));
+    hits = trie.collect_matches("aaaab");
+    assert(hits.size() == 2 + 4);
+    assert(trie.compile().collect_matches("aaaab") == hits);
+}
+
+// the match_kind semantics computed the slow way, from the list of all overlapping matches.
+template<typename BeginEndValue>
+std::vector<BeginEndValue> select_matches(std::vector<BeginEndValue> all, aho_corasick::match_kind kind) {
+    std::vector<BeginEndValue> result;
+    std::size_t from = 0;
+    while (true) {
+        const BeginEndValue *best = nullptr;
+        for (const auto &m : all) {
+            if (m.begin < from) {
+                continue;
+            }
+            if (!best) {
+                best = &m;
+            } else if (kind == aho_corasick::match_kind::non_overlapping) {
+                if (m.end < best->end || (m.end == best->end && m.begin < best->begin)) {
+                    best = &m;
+                }
+            } else if (m.begin < best->begin ||
+                       (m.begin == best->begin && (kind == aho_corasick::match_kind::leftmost_longest ? m.end > best->end : m.v < best->v))) {
+                best = &m;
+            }
+        }
+        if (!best) {
+            return result;
+        }
+        result.push_back(*best);
+        from = best->end;
+    }
+}
+
+typedef std::vector<aho_corasick::basic_trie<std::string, std::size_t>::BeginEndValue> hits_type;
+
+void test15() {
+    const aho_corasick::match_kind kinds[] = {aho_corasick::match_kind::non_overlapping,
+                                              aho_corasick::match_kind::leftmost_first,
+                                              aho_corasick::match_kind::leftmost_longest};
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    trie.map("abcd", 0);
+    trie.map("bc", 1);
+    trie.map("b", 2);
+    trie.map("abcdef", 3);
+    assert((trie.collect_matches("xabcdefx", aho_corasick::match_kind::leftmost_first) == hits_type{{1, 5, 0}}));
+    assert((trie.collect_matches("xabcdefx", aho_corasick::match_kind::leftmost_longest) == hits_type{{1, 7, 3}}));
+    assert((trie.collect_matches("xabcdefx", aho_corasick::match_kind::non_overlapping) == hits_type{{2, 3, 2}}));
+    assert((trie.compile().collect_matches("xabcdefx", aho_corasick::match_kind::leftmost_first) == hits_type{{1, 5, 0}}));
+
+    // no kind reads the text twice, input iterators do for all of them.
+    {
+        aho_corasick::basic_trie<std::string, std::size_t> rescan;
+        rescan.map("abcd", 0);
+        rescan.map("bc", 1);
+        const std::string text = "abcbc";
+        assert((rescan.collect_matches(text, aho_corasick::match_kind::leftmost_longest) == hits_type{{1, 3, 1}, {3, 5, 1}}));
+        for (auto kind : kinds) {
+            std::istringstream iss(text);
+            assert(rescan.collect_matches(std::istreambuf_iterator<char>(iss), std::istreambuf_iterator<char>(), kind) ==
+                   rescan.collect_matches(text, kind));
+            (void) kind;
+        }
+        std::istringstream iss(text);
+        assert(rescan.collect_matches(std::istreambuf_iterator<char>(iss), std::istreambuf_iterator<char>(), aho_corasick::match_kind::overlapping).size() == 2);
+    }
+
+    // "ab" starts inside the longer state "yab", which goes on to "yabz" and only then fails.
+    {
+        aho_corasick::basic_trie<std::string, std::size_t> hidden;
+        hidden.map("ab", 0);
+        hidden.map("yabzw", 1);
+        hidden.map("b", 2);
+        for (auto kind : kinds) {
+            const auto expected = select_matches(hidden.collect_matches("yabzq"), kind);
+            assert(hidden.collect_matches("yabzq", kind) == expected);
+            assert(hidden.compile().collect_matches("yabzq", kind) == expected);
+        }
+        assert((hidden.collect_matches("yabzq", aho_corasick::match_kind::leftmost_first) == hits_type{{1, 3, 0}}));
+    }
+
+    // a long pattern that never matches keeps every position open up to its length: each position is still decided once.
+    {
+        const std::size_t m = 10000;
+        aho_corasick::basic_trie<std::string, std::size_t> prefix;
+        prefix.map("a", 0);
+        prefix.map(std::string(m, 'a') + "b", 1);
+        const std::string text(1 << 20, 'a');
+        const auto compiled = prefix.compile();
+        const auto dense = prefix.compile<aho_corasick::dense_transitions<char> >();
+        for (std::size_t k = 1; k < 3; ++k) {
+            const auto kind = kinds[k];
+            const auto start = std::chrono::steady_clock::now();
+            const auto hits = dense.collect_matches(text, kind);
+            const double seconds = seconds_since(start);
+            std::cerr << "match kind " << static_cast<int>(kind) << " behind a long prefix: " << hits.size() << " matches in " << seconds << "s" << std::endl;
+            assert(hits.size() == text.size());
+            for (std::size_t i = 0; i < hits.size(); ++i) {
+                assert(hits[i].begin == i && hits[i].end == i + 1 && hits[i].v == 0);
+            }
+            assert(compiled.collect_matches(text, kind) == hits);
+            assert(prefix.collect_matches(text, kind) == hits);
+            const auto tail = prefix.collect_matches(text + "b", kind); // the first mapped "a" still wins for leftmost_first.
+            assert(kind == aho_corasick::match_kind::leftmost_first ? tail == hits :
+                   tail.size() == text.size() - m + 1 && tail.back().begin == text.size() - m && tail.back().v == 1);
+            (void) tail;
+        }
+    }
+
+    std::srand(15);
+    for (int round = 0; round < 200; ++round) {
+        aho_corasick::basic_trie<std::string, std::size_t> random_trie;
+        std::set<std::string> seen;
+        for (std::size_t id = 0; seen.size() < 1 + static_cast<std::size_t>(std::rand() % 12);) {
+            std::string pattern(1 + std::rand() % 5, 'a');
+            for (auto &c : pattern) {
+                c = 'a' + std::rand() % 3;
+            }
+            if (seen.insert(pattern).second) {
+                random_trie.map(pattern, id++);
+            }
+        }
+        std::string text(std::rand() % 60, 'a');
+        for (auto &c : text) {
+            c = 'a' + std::rand() % 4;
+        }
+        const auto all = random_trie.collect_matches(text);
+        const auto compiled = random_trie.compile();
+        const auto dense = random_trie.compile<aho_corasick::dense_transitions<char> >();
+        const auto root_row = random_trie.compile<aho_corasick::dense_transitions<char, 1> >(); // the others are sparse.
+        assert(random_trie.collect_matches(text, aho_corasick::match_kind::overlapping) == all);
+        assert(root_row.collect_matches(text) == all);
+        for (auto kind : kinds) {
+            const auto expected = select_matches(all, kind);
+            assert(random_trie.collect_matches(text, kind) == expected);
+            assert(compiled.collect_matches(text, kind) == expected);
+            assert(dense.collect_matches(text, kind) == expected);
+            assert(root_row.collect_matches(text, kind) == expected);
+        }
+    }
+
+    std::vector<std::string> words = read_words(200000);
+    aho_corasick::basic_trie<std::string, std::size_t> big;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        big.map(words[i], i);
+    }
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 7) {
+        text += words[i];
+        text += ' ';
+    }
+    const auto compiled = big.compile();
+    for (auto kind : kinds) {
+        auto start = std::chrono::steady_clock::now();
+        const auto hits = compiled.collect_matches(text, kind);
+        std::cerr << "match kind " << static_cast<int>(kind) << ": " << hits.size() << " matches in " << seconds_since(start) << "s" << std::endl;
+        assert(big.collect_matches(text, kind) == hits);
+    }
+}
+
+template<typename automaton_type>
+void check_batch(const automaton_type &automaton, const std::vector<std::string> &documents) {
+    aho_corasick::match_batch batch;
+    for (int round = 0; round < 2; ++round) { // the second round reuses the buffers.
+        auto start = std::chrono::steady_clock::now();
+        const std::size_t before = allocations;
+        automaton.collect_batch(documents.begin(), documents.end(), batch);
+        const std::size_t batch_allocations = allocations - before;
+        double batch_time = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        std::size_t count = 0;
+        for (const auto &document : documents) {
+            count += automaton.collect_matches(document).size();
+        }
+        std::cerr << automaton.transition_table().name() << " batch: " << batch.records().size() << " matches in " << batch_time
+                  << "s, one by one in " << seconds_since(start) << "s" << std::endl;
+        assert(count == batch.records().size());
+        assert(round == 0 || batch_allocations == 0);
+        (void) batch_allocations;
+    }
+    assert(batch.document_count() == documents.size());
+    for (std::size_t d = 0; d < documents.size(); ++d) {
+        const auto expected = automaton.collect_matches(documents[d]);
+        assert(batch.match_count(d) == expected.size());
+        const aho_corasick::match_record *record = batch.begin(d);
+        for (const auto &hit : expected) {
+            assert(record->begin == hit.begin && record->end == hit.end && automaton.value(record->pattern) == hit.v);
+            (void) hit;
+            ++record;
+        }
+        assert(record == batch.end(d));
+    }
+}
+
+void test16() {
+    std::vector<std::string> words = read_words(200000);
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        trie.map(words[i], i);
+    }
+    std::vector<std::string> documents(words);
+    documents.push_back("");
+    documents.push_back(words.size() > 1 ? words[0] + words[1] : "");
+    check_batch(trie.compile(), documents);
+    check_batch(trie.compile<aho_corasick::dense_transitions<char> >(), documents);
+    assert(trie.compile().collect_batch(documents.begin(), documents.begin()).document_count() == 0);
+}
+
+void test17() {
+    std::vector<std::string> words = read_words(200000);
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        trie.map(words[i], i);
+    }
+    const auto compiled = trie.compile();
+    std::vector<std::string> requests;
+    for (std::size_t i = 0; i + 4 < words.size(); i += 5) {
+        requests.push_back(words[i] + " " + words[i + 2] + words[i + 4]);
+    }
+
+    std::vector<aho_corasick::basic_trie<std::string, std::size_t>::BeginEndValue> trie_sink;
+    std::vector<aho_corasick::compiled_trie<std::string, std::size_t>::BeginEndValue> compiled_sink;
+    std::vector<aho_corasick::match_record> record_sink;
+    for (int round = 0; round < 2; ++round) { // the first round grows the sinks.
+        const std::size_t before = allocations;
+        for (const auto &request : requests) {
+            trie_sink.clear();
+            trie.collect_matches(request, trie_sink);
+            compiled_sink.clear();
+            compiled.collect_matches(request, compiled_sink, aho_corasick::match_kind::leftmost_longest);
+            record_sink.clear();
+            compiled.collect_matches(request, record_sink);
+        }
+        if (round == 1) {
+            assert(allocations == before);
+        }
+        (void) before;
+    }
+
+    for (const auto &request : requests) {
+        trie_sink.clear();
+        trie.collect_matches(request, trie_sink);
+        assert(trie_sink == trie.collect_matches(request));
+        record_sink.clear();
+        compiled.collect_matches(request.begin(), request.end(), record_sink);
+        assert(record_sink.size() == trie_sink.size());
+        for (std::size_t i = 0; i < record_sink.size(); ++i) {
+            assert(record_sink[i].begin == trie_sink[i].begin && record_sink[i].end == trie_sink[i].end);
+            assert(compiled.value(record_sink[i].pattern) == trie_sink[i].v);
+        }
+    }
+    // sinks are appended to.
+    compiled_sink.clear();
+    compiled.collect_matches(requests[0], compiled_sink);
+    compiled.collect_matches(requests[1], compiled_sink);
+    assert(compiled_sink.size() == compiled.collect_matches(requests[0]).size() + compiled.collect_matches(requests[1]).size());
+}
+
+template<typename automaton_type>
+void check_queries(const automaton_type &automaton, const std::string &text) {
+    const auto hits = automaton.collect_matches(text);
+    assert(automaton.contains_any(text) == !hits.empty());
+    assert(automaton.count_matches(text) == hits.size());
+    std::size_t b = 0, e = 0;
+    const auto *first = automaton.find_first(text, &b, &e);
+    (void) first;
+    const auto leftmost = automaton.collect_matches(text, aho_corasick::match_kind::non_overlapping);
+    assert(first ? !leftmost.empty() && *first == leftmost[0].v && b == leftmost[0].begin && e == leftmost[0].end : hits.empty());
+    std::vector<std::size_t> histogram(3, 7);
+    assert(automaton.count_pattern_matches(text, histogram) == hits.size());
+    assert(histogram.size() == automaton.pattern_id_count());
+    std::size_t total = 0;
+    for (auto n : histogram) {
+        total += n;
+    }
+    assert(total == hits.size());
+}
+
+void test18() {
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    trie.map("hers", 0);
+    trie.map("his", 1);
+    trie.map("she", 2);
+    trie.map("he", 3);
+    std::vector<std::size_t> histogram;
+    assert(trie.count_pattern_matches(std::string("ushers he"), histogram) == 4);
+    assert((histogram == std::vector<std::size_t>{1, 0, 1, 2}));
+    assert(!trie.contains_any(std::string("xyz")) && !trie.find_first(std::string("xyz")));
+    check_queries(trie, "ushers");
+    check_queries(trie.compile(), "ushers");
+
+    std::vector<std::string> words = read_words(200000);
+    aho_corasick::basic_trie<std::string, std::size_t> big;
+    for (std::size_t i = 0; i < words.size(); i += 2) {
+        big.map(words[i], i);
+    }
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 3) {
+        text += words[i];
+        text += ' ';
+    }
+    check_queries(big, text);
+    check_queries(big, text.substr(0, 10));
+    const auto compiled = big.compile<aho_corasick::dense_transitions<char> >();
+    check_queries(compiled, text);
+    auto start = std::chrono::steady_clock::now();
+    const std::size_t count = compiled.count_matches(text);
+    double count_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    assert(compiled.collect_matches(text).size() == count);
+    std::cerr << "counted " << count << " matches in " << count_time << "s, collected in " << seconds_since(start) << "s" << std::endl;
+}
+
+template<typename automaton_type, typename container_type>
+std::vector<std::pair<std::size_t, std::size_t> > match_positions(const automaton_type &automaton, const container_type &text) {
+    std::vector<std::pair<std::size_t, std::size_t> > positions;
+    automaton.iterate_matches(text.begin(), text.end(),
+                              [&](const std::string &,
+                                  const typename container_type::const_iterator &begin,
+                                  const typename container_type::const_iterator &end) {
+                                  positions.push_back(std::make_pair(std::distance(text.begin(), begin),
+                                                                     std::distance(text.begin(), end)));
+                                  return true;
+                              });
+    return positions;
+}
+
+void test19() {
+    aho_corasick::trie trie;
+    trie.insert("hers");
+    trie.insert("his");
+    trie.insert("she");
+    trie.insert("he");
+    const std::string text = "ushers and his sheep";
+    const std::list<char> list_text(text.begin(), text.end());
+    const std::forward_list<char> forward_text(text.begin(), text.end());
+    const auto expected = match_positions(trie, text);
+    assert(expected.size() == 6);
+    assert(match_positions(trie, list_text) == expected);
+    assert(match_positions(trie, forward_text) == expected);
+    assert(match_positions(trie.compile(), forward_text) == expected);
+
+    // input iterators: offsets only.
+    const auto hits = trie.collect_matches(text);
+    {
+        std::istringstream iss(text);
+        assert(trie.collect_matches(std::istreambuf_iterator<char>(iss), std::istreambuf_iterator<char>()) == hits);
+    }
+    {
+        std::istringstream iss(text);
+        assert(trie.compile().collect_matches(std::istreambuf_iterator<char>(iss), std::istreambuf_iterator<char>()) == hits);
+    }
+    {
+        std::istringstream iss(text);
+        assert(trie.count_matches(std::istreambuf_iterator<char>(iss), std::istreambuf_iterator<char>()) == hits.size());
+    }
+
+    // long patterns with a hit at every position.
+    aho_corasick::trie deep;
+    deep.insert(std::string(1000, 'a'));
+    const std::list<char> run(50000, 'a');
+    std::size_t count = 0;
+    auto start = std::chrono::steady_clock::now();
+    deep.iterate_matches(run.begin(), run.end(),
+                         [&](const std::string &, const std::list<char>::const_iterator &begin, const std::list<char>::const_iterator &) {
+                             count += *begin == 'a';
+                             return true;
+                         });
+    std::cerr << count << " matches of a 1000 symbol pattern in a list in " << seconds_since(start) << "s" << std::endl;
+    assert(count == run.size() - 999);
+}
+
+void test20() {
+    // random updates on an incremental trie against a trie built from scratch with the same patterns.
+    std::srand(20);
+    for (int round = 0; round < 100; ++round) {
+        aho_corasick::basic_trie<std::string, std::size_t> trie;
+        std::map<std::string, std::size_t> patterns;
+        auto random_string = [](std::size_t max_length, int letters) {
+            std::string s(1 + std::rand() % max_length, 'a');
+            for (auto &c : s) {
+                c = 'a' + std::rand() % letters;
+            }
+            return s;
+        };
+        for (int i = 0; i < 5; ++i) {
+            std::string pattern = random_string(4, 3);
+            trie.map(pattern, i);
+            patterns[pattern] = i;
+        }
+        trie.enable_incremental_updates();
+        std::string text = random_string(80, 4);
+        for (int step = 0; step < 30; ++step) {
+            std::string pattern = random_string(5, 3);
+            if (std::rand() % 2 && !patterns.empty()) {
+                auto it = patterns.begin();
+                std::advance(it, std::rand() % patterns.size());
+                assert(trie.erase(it->first));
+                patterns.erase(it);
+            } else {
+                trie.map(pattern, step + 100);
+                patterns[pattern] = step + 100;
+            }
+            aho_corasick::basic_trie<std::string, std::size_t> fresh;
+            for (const auto &p : patterns) {
+                fresh.map(p.first, p.second);
+            }
+            std::vector<std::pair<std::size_t, std::size_t> > got, expected;
+            for (const auto &hit : trie.collect_matches(text)) {
+                got.push_back(std::make_pair(hit.end, hit.v));
+            }
+            for (const auto &hit : fresh.collect_matches(text)) {
+                expected.push_back(std::make_pair(hit.end, hit.v));
+            }
+            assert(got == expected);
+            assert(trie.compile().size() == fresh.compile().size()); // no dead states left behind.
+        }
+        assert(!trie.erase(std::string("zzz")));
+    }
+
+    // erasing without incremental updates leaves stale links behind until the next traversal rebuilds them.
+    {
+        aho_corasick::trie t;
+        t.insert("he");
+        t.insert("she");
+        assert(t.collect_matches("ushers").size() == 2);
+        assert(t.erase(std::string("he")));
+        std::string dot = t.toDot();
+        assert(dot.find("\\rhe\\r") == std::string::npos);
+        assert(t.collect_matches("ushers").size() == 1);
+    }
+
+    // a batch of updates on a dictionary, against rebuilding the failure links.
+    std::vector<std::string> words = read_words(20000);
+    aho_corasick::basic_trie<std::string, std::size_t> big;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        big.map(words[i], i);
+    }
+    auto start = std::chrono::steady_clock::now();
+    big.enable_incremental_updates();
+    double build_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < words.size(); i += 10) {
+        big.erase(words[i]);
+        big.map(words[i] + "-new", i);
+    }
+    double update_time = seconds_since(start);
+    std::cerr << "failure links in " << build_time << "s, " << words.size() / 5 << " updates in " << update_time << "s" << std::endl;
+    aho_corasick::basic_trie<std::string, std::size_t> fresh;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        fresh.map(i % 10 ? words[i] : words[i] + "-new", i);
+    }
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 3) {
+        text += words[i] + (i % 2 ? "-new" : " ");
+    }
+    assert(big.count_matches(text) == fresh.count_matches(text));
+    assert(big.compile().size() == fresh.compile().size());
+
+    // a long chain of single-letter extensions: the state of every a...a fails to the one a shorter, so a payload on
+    // "a" changes the output link of the whole chain, and each longer prefix that gets one after it changes the rest.
+    // the updates fall back to a rebuild instead of walking (or recursing down) the chain every time.
+    const std::size_t chain_length = 300000;
+    aho_corasick::basic_trie<std::string, std::size_t> chain;
+    chain.enable_incremental_updates();
+    chain.map(std::string(chain_length, 'a'), chain_length);
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 1; i <= 100; ++i) {
+        chain.map(std::string(i, 'a'), i);
+    }
+    std::cerr << "100 prefixes of a chain of " << chain_length << " states in " << seconds_since(start) << "s" << std::endl;
+    const std::string as(chain_length, 'a');
+    std::size_t expected_count = 1; // the whole chain.
+    for (std::size_t i = 1; i <= 100; ++i) {
+        expected_count += chain_length + 1 - i;
+    }
+    assert(chain.count_matches(as) == expected_count);
+    chain.map(std::string(200, 'a'), 200);
+    assert(chain.count_matches(as) == expected_count + chain_length + 1 - 200);
+    assert(chain.erase(std::string(1, 'a')));
+    assert(chain.count_matches(as) == expected_count + chain_length + 1 - 200 - chain_length);
+    (void) expected_count;
+}
+
+void test21() {
+    std::vector<std::string> words = read_words(200000);
+    std::vector<std::pair<std::string, std::size_t> > sorted;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        sorted.push_back(std::make_pair(words[i], i));
+    }
+    sorted.push_back(std::make_pair(std::string(), words.size())); // the empty pattern, on the root.
+    std::sort(sorted.begin(), sorted.end());
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 3) {
+        text += words[i] + " ";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    aho_corasick::basic_trie<std::string, std::size_t> one_by_one;
+    for (const auto &p : sorted) {
+        one_by_one.map(p.first, p.second);
+    }
+    double map_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    one_by_one.construct_failure_states();
+    double serial_time = seconds_since(start);
+    const auto expected = one_by_one.collect_matches(text, aho_corasick::match_kind::leftmost_first);
+    const auto all = one_by_one.collect_matches(text);
+
+    for (std::size_t threads : {1, 4}) {
+        start = std::chrono::steady_clock::now();
+        aho_corasick::basic_trie<std::string, std::size_t> bulk;
+        bulk.map_sorted(sorted, threads);
+        double bulk_time = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        bulk.construct_failure_states(threads);
+        std::cerr << threads << " threads: map_sorted " << bulk_time << "s (map " << map_time << "s), failure links "
+                  << seconds_since(start) << "s (serial " << serial_time << "s)" << std::endl;
+        assert(bulk.max_depth() == one_by_one.max_depth());
+        assert(bulk.collect_matches(text, aho_corasick::match_kind::leftmost_first) == expected);
+        assert(bulk.collect_matches(text) == all);
+        assert(bulk.compile().size() == one_by_one.compile().size());
+    }
+
+    // unsorted input and a non thread safe storage fall back to a single thread.
+    std::vector<std::pair<std::string, std::size_t> > shuffled(sorted);
+    std::reverse(shuffled.begin(), shuffled.end());
+    aho_corasick::basic_trie<std::string, std::size_t> unsorted;
+    unsorted.map_sorted(shuffled, 4);
+    assert(unsorted.collect_matches(text) == all);
+    aho_corasick::basic_trie<std::string, std::size_t, aho_corasick::arena_storage> arena;
+    arena.map_sorted(sorted, 4);
+    arena.construct_failure_states(4);
+    assert(arena.collect_matches(text) == all);
+
+    // the parallel build keeps the failure tree of incremental updates.
+    aho_corasick::basic_trie<std::string, std::size_t> incremental;
+    incremental.map_sorted(sorted, 4);
+    incremental.enable_incremental_updates();
+    incremental.construct_failure_states(4);
+    for (std::size_t i = 0; i < words.size(); i += 5) {
+        incremental.erase(words[i]);
+        incremental.map(words[i], i);
+    }
+    assert(incremental.count_matches(text) == all.size());
+}
+
+void test22() {
+    aho_corasick::basic_trie<std::string, std::size_t> trie;
+    trie.map(std::string("he"), 0);
+    trie.map(std::string("she"), 1);
+    trie.map(std::string("his"), 2);
+    trie.map(std::string("hers"), 3);
+    aho_corasick::trie_statistics stats = trie.statistics();
+    assert(stats.states == 10);
+    assert(stats.transitions == 9);
+    assert(stats.patterns == 4);
+    assert((stats.fan_out == std::vector<std::size_t>{3, 5, 2}));
+    assert((stats.depth == std::vector<std::size_t>{1, 2, 3, 3, 1}));
+    assert((stats.failure_chain == std::vector<std::size_t>{1, 5, 4})); // sh, his, she and hers fail to h, s or he.
+    assert(stats.average_failure_chain() == 1.3);
+    assert(stats.state_bytes > 0 && stats.transition_bytes > 0 && stats.payload_bytes == 4 * sizeof(std::size_t));
+    assert(stats.storage_bytes == 0 && stats.total_bytes() == stats.state_bytes + stats.transition_bytes + stats.payload_bytes);
+
+    aho_corasick::basic_trie<std::string, std::size_t, aho_corasick::arena_storage> arena;
+    arena.map(std::string("he"), 0);
+    arena.map(std::string("hers"), 3);
+    aho_corasick::trie_statistics arena_stats = arena.statistics();
+    assert(arena_stats.states == 5 && arena_stats.storage_bytes > 0);
+    assert(arena_stats.total_bytes() == arena_stats.storage_bytes);
+    arena.enable_incremental_updates(); // the parents and the failure tree go to a side table, not into the states.
+    const aho_corasick::trie_statistics incremental_stats = arena.statistics();
+    assert(incremental_stats.state_bytes == arena_stats.state_bytes && incremental_stats.link_bytes > 0);
+    assert(incremental_stats.total_bytes() == incremental_stats.storage_bytes + incremental_stats.link_bytes);
+
+#ifdef AHO_CORASICK_SCAN_COUNTERS
+    const std::string text("ushers");
+    aho_corasick::scan_counters &counters = aho_corasick::thread_scan_counters();
+    counters.reset();
+    assert(trie.collect_matches(text).size() == 3);
+    assert(counters.symbols == 6 && counters.skipped_symbols == 0);
+    assert(counters.failure_hops == 1); // she -r-> her.
+    assert(counters.states_visited == 7);
+    assert(counters.matches == 3);
+    assert(counters.failure_hops_per_symbol() == 1.0 / 6);
+
+    const auto sorted = trie.compile();
+    counters.reset();
+    assert(sorted.count_matches(text) == 3);
+    assert(counters.skipped_symbols == 1 && counters.symbols == 5); // no pattern starts with u.
+    assert(counters.failure_hops == 1 && counters.states_visited == 6 && counters.matches == 3);
+
+    const auto dense = trie.compile<aho_corasick::dense_transitions<char> >();
+    counters.reset();
+    assert(dense.find_first(text) != nullptr);
+    assert(counters.symbols == 3 && counters.failure_hops == 0 && counters.matches == 1);
+
+    // every thread counts for itself.
+    std::thread([&trie, &text]() {
+        assert(aho_corasick::thread_scan_counters().symbols == 0);
+        trie.count_matches(text);
+        assert(aho_corasick::thread_scan_counters().symbols == 6);
+    }).join();
+    assert(counters.symbols == 3);
+#endif
+}
+
+std::string ascii_lower(std::string s) {
+    for (auto &c : s) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+    return s;
+}
+
+std::string random_case(std::string s) {
+    for (auto &c : s) {
+        if (c >= 'a' && c <= 'z' && std::rand() % 2) {
+            c = static_cast<char>(c - 'a' + 'A');
+        }
+    }
+    return s;
+}
+
+// a folding automaton scanning the text finds what a plain one finds in the folded copy.
+template<typename automaton_type, typename reference_type>
+void check_folded(const automaton_type &automaton, const reference_type &reference, const std::string &text, const std::string &folded) {
+    const auto expected = reference.collect_matches(folded);
+    assert(automaton.collect_matches(text) == expected);
+    assert(automaton.collect_matches(text, aho_corasick::match_kind::leftmost_longest) ==
+           reference.collect_matches(folded, aho_corasick::match_kind::leftmost_longest));
+    assert(automaton.count_matches(text) == expected.size());
+    (void) automaton;
+    (void) text;
+}
+
+void test23() {
+    typedef aho_corasick::basic_trie<std::string, std::size_t, aho_corasick::heap_storage, aho_corasick::ascii_case_folding<char> > folding_trie;
+    std::vector<std::string> words = read_words(20000);
+    std::srand(23);
+    folding_trie folding;
+    aho_corasick::basic_trie<std::string, std::size_t> lower;
+    std::vector<std::pair<std::string, std::size_t> > sorted;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        folding.map(random_case(words[i]), i);
+        lower.map(ascii_lower(words[i]), i);
+        sorted.push_back(std::make_pair(random_case(words[i]), i));
+    }
+    std::string text;
+    for (std::size_t i = 0; i < words.size(); i += 3) {
+        text += random_case(words[i]) + " ";
+    }
+    const std::string folded = ascii_lower(text);
+    assert(folding.statistics().states == lower.statistics().states); // equivalent patterns share their states.
+    const std::size_t *found = folding.getNoCreate(random_case(words[0]));
+    assert(found && *found == *lower.getNoCreate(ascii_lower(words[0])));
+    (void) found;
+
+    check_folded(folding, lower, text, folded);
+    check_folded(folding.compile(), lower, text, folded);
+    check_folded(folding.compile<aho_corasick::double_array_transitions<char> >(), lower, text, folded);
+    const auto dense = folding.compile<aho_corasick::dense_transitions<char> >();
+    check_folded(dense, lower, text, folded);
+    assert(dense.transition_table().class_count() == lower.compile<aho_corasick::dense_transitions<char> >().transition_table().class_count());
+
+    // sorted on the folded patterns, the threads split on folded first symbols.
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, std::size_t> &a, const std::pair<std::string, std::size_t> &b) {
+        return ascii_lower(a.first) < ascii_lower(b.first);
+    });
+    folding_trie bulk;
+    bulk.map_sorted(sorted, 4);
+    assert(bulk.statistics().states == lower.statistics().states);
+    assert(bulk.count_matches(text) == lower.count_matches(folded));
+
+    // the map is saved with the automaton.
+    std::ostringstream oss;
+    dense.save(oss);
+    const std::string image = oss.str();
+    const auto loaded = decltype(dense)::load(nullptr, image.data(), image.size());
+    check_folded(loaded, lower, text, folded);
+    bool thrown = false;
+    try {
+        aho_corasick::compiled_trie<std::string, std::size_t, aho_corasick::dense_transitions<char> >::load(nullptr, image.data(), image.size());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    (void) thrown;
+
+    // every digit stands for 0.
+    aho_corasick::byte_class_map<char> digits;
+    digits.map('0', '9', '0');
+    aho_corasick::basic_trie<std::string, std::size_t, aho_corasick::arena_storage, aho_corasick::byte_class_map<char> > ids(aho_corasick::arena_storage(), digits);
+    ids.map(std::string("id00"), 0);
+    ids.map(std::string("v0.0"), 1);
+    ids.map(std::string("id42"), 2); // the same pattern as id00.
+    assert(ids.statistics().patterns == 2);
+    const std::string versions("id17 v1.7 id9 v2.10 ID12");
+    typedef aho_corasick::begin_end_value<std::size_t> bev;
+    const std::size_t id = 2, version = 1;
+    const std::vector<bev> expected{bev{0, 4, id}, bev{5, 9, version}, bev{14, 18, version}};
+    assert(ids.collect_matches(versions) == expected);
+    const auto ids_dense = ids.compile<aho_corasick::dense_transitions<char> >();
+    assert(ids_dense.collect_matches(versions) == expected);
+    assert(ids_dense.transition_table().class_count() == 6); // i, d, v, ., the digits and everything else.
+    assert(ids.compile().collect_matches(versions) == expected);
+}
+
+void test24() {
+    assert(aho_corasick::to_utf8(std::wstring(L"a\u00e9\u4e2d")) == "a\xc3\xa9\xe4\xb8\xad");
+    assert(aho_corasick::to_utf8(std::u16string(u"\U0001F600")) == "\xf0\x9f\x98\x80"); // a surrogate pair.
+    bool thrown = false;
+    try {
+        aho_corasick::to_utf8(std::u16string(1, char16_t(0xd800)));
+    } catch (const std::invalid_argument &) {
+        thrown = true;
+    }
+    assert(thrown);
+    (void) thrown;
+
+    aho_corasick::wtrie small;
+    small.insert(L"t");
+    small.insert(L"h\u00e9");
+    small.insert(L"\u00e9t\u00e9");
+    small.insert(L"\u4e2d\u6587");
+    const std::wstring small_text(L"th\u00e9 \u00e9t\u00e9 \u4e2d\u6587!");
+    const std::string small_utf8 = aho_corasick::to_utf8(small_text);
+    const auto small_bytes = small.compile_utf8();
+    assert(aho_corasick::collect_utf8_matches(small_bytes, small_utf8.begin(), small_utf8.end()) == small.collect_matches(small_text));
+    const auto byte_matches = small_bytes.collect_matches(small_utf8);
+    assert(byte_matches.size() == 5); // t, h\u00e9, t, \u00e9t\u00e9 and \u4e2d\u6587.
+    assert(byte_matches[1].begin == 1 && byte_matches[1].end == 4 && byte_matches[1].v == L"h\u00e9");
+    assert(byte_matches[3].begin == 5 && byte_matches[3].end == 10);
+    assert(byte_matches[4].begin == 11 && byte_matches[4].end == 17 && byte_matches[4].v == L"\u4e2d\u6587");
+
+    // dictionary words with accents and cjk characters, the byte automata find what the wide one finds.
+    std::vector<std::string> words = read_words(20000);
+    aho_corasick::wtrie wide;
+    std::vector<std::wstring> wide_words;
+    for (const auto &word : words) {
+        std::wstring w(word.begin(), word.end());
+        for (auto &c : w) {
+            c = c == L'e' ? L'\u00e9' : c == L'a' ? L'\u4e2d' : c;
+        }
+        wide.insert(w);
+        wide_words.push_back(w);
+    }
+    std::wstring text;
+    for (std::size_t i = 0; i < wide_words.size(); i += 3) {
+        text += wide_words[i] + L" ";
+    }
+    const std::string utf8 = aho_corasick::to_utf8(text);
+    const auto expected = wide.collect_matches(text);
+    const auto leftmost = wide.collect_matches(text, aho_corasick::match_kind::leftmost_longest);
+    const auto dense = wide.compile_utf8();
+    assert(aho_corasick::collect_utf8_matches(dense, utf8.begin(), utf8.end()) == expected);
+    assert(aho_corasick::collect_utf8_matches(dense, utf8.begin(), utf8.end(), aho_corasick::match_kind::leftmost_longest) == leftmost);
+    assert(dense.count_matches(utf8) == expected.size());
+    const auto sorted = wide.compile_utf8<aho_corasick::sorted_transitions<char> >();
+    assert(aho_corasick::collect_utf8_matches(sorted, utf8.begin(), utf8.end()) == expected);
+    const auto leftmost_first = wide.collect_matches(text, aho_corasick::match_kind::leftmost_first);
+    assert(aho_corasick::collect_utf8_matches(sorted, utf8.begin(), utf8.end(), aho_corasick::match_kind::leftmost_first) == leftmost_first);
+}
+
 int main() {
     test0();
     test1();
     test2();
-    test3();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
+    test22();
+    test23();
+    test24();
+    test3(); // checks every word against all others, quadratic in the size of the word list: last.
     // dot -Tpng /tmp/blaat.dot  > /tmp/blaat.png && feh /tmp/blaat.png
 }